@@ -0,0 +1,519 @@
+#include "BinaryScene.h"
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char binMagic[8] = {'P', 'B', 'R', 'T', 'S', 'C', 'N', 0};
+
+static inline uint64_t align16(uint64_t offset) {
+	return (offset + 15) & ~(uint64_t)15;
+}
+
+// =====================================================================================
+//                           WRITING
+// =====================================================================================
+
+//
+// BinStrings
+// String table, every distinct string is stored once.
+//
+struct BinStrings {
+	std::string data;
+	std::unordered_map<std::string, uint32_t> offsets;
+
+	uint32_t add(const std::string &s) {
+		auto it = offsets.find(s);
+		if (it != offsets.end()) return it->second;
+		auto offset = (uint32_t)data.size();
+		data.append(s.c_str(), s.size() + 1);
+		offsets[s] = offset;
+		return offset;
+	}
+};
+
+static void copy_frame(float *dst, const ygl::frame3f &f) {
+	memcpy(dst, &f.x.x, sizeof(float) * 12);
+}
+
+static void copy_vec3(float *dst, const ygl::vec3f &v) {
+	memcpy(dst, &v.x, sizeof(float) * 3);
+}
+
+static BinTextureRef make_texture_ref(const ygl::texture *txt, const ygl::texture_info *info,
+	const std::unordered_map<const ygl::texture*, int> &textureIds) {
+	BinTextureRef ref{};
+	ref.texture = (txt) ? textureIds.at(txt) : -1;
+	ref.scale = 1;
+	if (info) {
+		ref.hasInfo = 1;
+		ref.wrapS = info->wrap_s;
+		ref.wrapT = info->wrap_t;
+		ref.linear = info->linear;
+		ref.mipmap = info->mipmap;
+		ref.scale = info->scale;
+	}
+	return ref;
+}
+
+// raw bytes of the arrays of a shape, in the order of BinShape::arrays
+static void shape_arrays(const ygl::shape *shp, const void *data[15], uint64_t sizes[15], uint64_t counts[15]) {
+#define BIN_ARRAY(i, name) \
+	data[i] = shp->name.data(); \
+	counts[i] = shp->name.size(); \
+	sizes[i] = shp->name.size() * sizeof(shp->name[0]);
+	BIN_ARRAY(0, points)
+	BIN_ARRAY(1, lines)
+	BIN_ARRAY(2, triangles)
+	BIN_ARRAY(3, quads)
+	BIN_ARRAY(4, quads_pos)
+	BIN_ARRAY(5, quads_norm)
+	BIN_ARRAY(6, quads_texcoord)
+	BIN_ARRAY(7, beziers)
+	BIN_ARRAY(8, pos)
+	BIN_ARRAY(9, norm)
+	BIN_ARRAY(10, texcoord)
+	BIN_ARRAY(11, texcoord1)
+	BIN_ARRAY(12, color)
+	BIN_ARRAY(13, radius)
+	BIN_ARRAY(14, tangsp)
+#undef BIN_ARRAY
+}
+
+// writes a section of records and sets its offset
+template <typename T>
+static void write_records(BufferedWriter &out, uint64_t &offset, const std::vector<T> &records) {
+	static const char zeros[16] = {0};
+	auto aligned = align16(offset);
+	out.put(zeros, aligned - offset);
+	out.put((const char*)records.data(), records.size() * sizeof(T));
+	offset = aligned + records.size() * sizeof(T);
+}
+
+void write_binary_scene(const std::string &filename, const ygl::scene *scn, bool saveTextures, bool skipMissing,
+	const TextureSources *textureSources, const TextureImages *textureImages) {
+	auto strings = BinStrings();
+	auto textureIds = std::unordered_map<const ygl::texture*, int>();
+	auto materialIds = std::unordered_map<const ygl::material*, int>();
+	auto groupIds = std::unordered_map<const ygl::shape_group*, int>();
+
+	auto textures = std::vector<BinTexture>();
+	for (auto txt : scn->textures) {
+		auto btxt = BinTexture();
+		btxt.path = strings.add(txt->path);
+		auto ext = ygl::path_extension(txt->path);
+		// textures copied from their source file have no pixels (and size 0)
+		auto img = texture_image(txt, textureImages);
+		if (img) {
+			btxt.hdr = !img->hdr.empty();
+			btxt.width = img->width;
+			btxt.height = img->height;
+		}
+		else {
+			btxt.hdr = !txt->hdr.empty() || (txt->ldr.empty() && (ext == ".hdr" || ext == ".exr"));
+			btxt.width = (btxt.hdr) ? txt->hdr.width() : txt->ldr.width();
+			btxt.height = (btxt.hdr) ? txt->hdr.height() : txt->ldr.height();
+		}
+		textureIds[txt] = (int)textures.size();
+		textures.push_back(btxt);
+	}
+
+	auto materials = std::vector<BinMaterial>();
+	for (auto mat : scn->materials) {
+		auto bmat = BinMaterial();
+		bmat.name = strings.add(mat->name);
+		bmat.type = (uint32_t)mat->type;
+		bmat.doubleSided = mat->double_sided;
+		copy_vec3(bmat.ke, mat->ke);
+		copy_vec3(bmat.kd, mat->kd);
+		copy_vec3(bmat.ks, mat->ks);
+		copy_vec3(bmat.kr, mat->kr);
+		copy_vec3(bmat.kt, mat->kt);
+		bmat.rs = mat->rs;
+		bmat.op = mat->op;
+		const ygl::texture *txts[10] = {mat->ke_txt, mat->kd_txt, mat->ks_txt, mat->kr_txt,
+			mat->kt_txt, mat->rs_txt, mat->bump_txt, mat->disp_txt, mat->norm_txt, mat->occ_txt};
+		const ygl::texture_info *infos[10] = {mat->ke_txt_info, mat->kd_txt_info, mat->ks_txt_info,
+			mat->kr_txt_info, mat->kt_txt_info, mat->rs_txt_info, mat->bump_txt_info,
+			mat->disp_txt_info, mat->norm_txt_info, mat->occ_txt_info};
+		for (auto i = 0; i < 10; i++)
+			bmat.textures[i] = make_texture_ref(txts[i], infos[i], textureIds);
+		materialIds[mat] = (int)materials.size();
+		materials.push_back(bmat);
+	}
+
+	// shapes, with the offsets of their arrays after all the records
+	auto groups = std::vector<BinShapeGroup>();
+	auto shapes = std::vector<BinShape>();
+	for (auto sgr : scn->shapes) {
+		auto bsgr = BinShapeGroup();
+		bsgr.name = strings.add(sgr->name);
+		bsgr.path = strings.add(sgr->path);
+		bsgr.firstShape = (uint32_t)shapes.size();
+		bsgr.numShapes = (uint32_t)sgr->shapes.size();
+		groupIds[sgr] = (int)groups.size();
+		groups.push_back(bsgr);
+		for (auto shp : sgr->shapes) {
+			BinShape bshp{};
+			bshp.name = strings.add(shp->name);
+			bshp.material = (shp->mat) ? materialIds.at(shp->mat) : -1;
+			bshp.subdivision = shp->subdivision;
+			bshp.catmullclark = shp->catmullclark;
+			shapes.push_back(bshp);
+		}
+	}
+
+	auto instances = std::vector<BinInstance>();
+	for (auto ist : scn->instances) {
+		auto bist = BinInstance();
+		bist.name = strings.add(ist->name);
+		bist.shapeGroup = (ist->shp) ? groupIds.at(ist->shp) : -1;
+		copy_frame(bist.frame, ist->frame);
+		instances.push_back(bist);
+	}
+
+	auto cameras = std::vector<BinCamera>();
+	for (auto cam : scn->cameras) {
+		auto bcam = BinCamera();
+		bcam.name = strings.add(cam->name);
+		bcam.ortho = cam->ortho;
+		copy_frame(bcam.frame, cam->frame);
+		bcam.yfov = cam->yfov;
+		bcam.aspect = cam->aspect;
+		bcam.focus = cam->focus;
+		bcam.aperture = cam->aperture;
+		bcam.near = cam->near;
+		bcam.far = cam->far;
+		cameras.push_back(bcam);
+	}
+
+	auto environments = std::vector<BinEnvironment>();
+	for (auto env : scn->environments) {
+		auto benv = BinEnvironment();
+		benv.name = strings.add(env->name);
+		copy_frame(benv.frame, env->frame);
+		copy_vec3(benv.ke, env->ke);
+		benv.keTxt = make_texture_ref(env->ke_txt, env->ke_txt_info, textureIds);
+		environments.push_back(benv);
+	}
+
+	// layout
+	BinHeader header{};
+	memcpy(header.magic, binMagic, 8);
+	header.version = BINARY_SCENE_VERSION;
+	header.headerSize = sizeof(BinHeader);
+	auto offset = (uint64_t)sizeof(BinHeader);
+	auto place = [&offset](BinSection &section, uint64_t count, uint64_t size) {
+		offset = align16(offset);
+		section.offset = offset;
+		section.count = count;
+		offset += size;
+	};
+	place(header.strings, strings.data.size(), strings.data.size());
+	place(header.textures, textures.size(), textures.size() * sizeof(BinTexture));
+	place(header.materials, materials.size(), materials.size() * sizeof(BinMaterial));
+	place(header.shapeGroups, groups.size(), groups.size() * sizeof(BinShapeGroup));
+	place(header.shapes, shapes.size(), shapes.size() * sizeof(BinShape));
+	place(header.instances, instances.size(), instances.size() * sizeof(BinInstance));
+	place(header.cameras, cameras.size(), cameras.size() * sizeof(BinCamera));
+	place(header.environments, environments.size(), environments.size() * sizeof(BinEnvironment));
+	const void *data[15];
+	uint64_t sizes[15], counts[15];
+	auto shapeId = 0;
+	for (auto sgr : scn->shapes) {
+		for (auto shp : sgr->shapes) {
+			shape_arrays(shp, data, sizes, counts);
+			for (auto i = 0; i < 15; i++)
+				place(shapes[shapeId].arrays[i], counts[i], sizes[i]);
+			shapeId++;
+		}
+	}
+	header.fileSize = offset;
+
+	// write the sections in the order they have been placed
+	BufferedWriter out(filename, 16 << 20, 0);
+	out.put((const char*)&header, sizeof(header));
+	offset = sizeof(header);
+	write_records(out, offset, std::vector<char>(strings.data.begin(), strings.data.end()));
+	write_records(out, offset, textures);
+	write_records(out, offset, materials);
+	write_records(out, offset, groups);
+	write_records(out, offset, shapes);
+	write_records(out, offset, instances);
+	write_records(out, offset, cameras);
+	write_records(out, offset, environments);
+	static const char zeros[16] = {0};
+	for (auto sgr : scn->shapes) {
+		for (auto shp : sgr->shapes) {
+			shape_arrays(shp, data, sizes, counts);
+			for (auto i = 0; i < 15; i++) {
+				auto aligned = align16(offset);
+				out.put(zeros, aligned - offset);
+				out.put((const char*)data[i], sizes[i]);
+				offset = aligned + sizes[i];
+			}
+		}
+	}
+	out.close();
+
+	if (saveTextures) {
+		auto to = TextureSaveOptions();
+		to.skipMissing = skipMissing;
+		to.sources = textureSources;
+		to.images = textureImages;
+		write_textures(scn, ygl::path_dirname(filename), to);
+	}
+}
+
+// =====================================================================================
+//                           LOADING
+// =====================================================================================
+
+//
+// MappedFile
+// A read only view of a whole file, mapped in memory where possible.
+//
+class MappedFile {
+	public:
+	const char *data = nullptr;
+	uint64_t size = 0;
+
+	MappedFile(const std::string &filename) {
+#ifdef _WIN32
+		auto f = fopen(filename.c_str(), "rb");
+		if (!f) throw std::runtime_error("cannot open filename " + filename);
+		fseek(f, 0, SEEK_END);
+		size = (uint64_t)ftell(f);
+		fseek(f, 0, SEEK_SET);
+		buffer.resize(size);
+		auto ok = fread(buffer.data(), 1, size, f) == size;
+		fclose(f);
+		if (!ok) throw std::runtime_error("cannot read filename " + filename);
+		data = buffer.data();
+#else
+		auto fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error("cannot open filename " + filename);
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			::close(fd);
+			throw std::runtime_error("cannot read filename " + filename);
+		}
+		size = (uint64_t)st.st_size;
+		if (size) {
+			auto ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (ptr == MAP_FAILED) {
+				::close(fd);
+				throw std::runtime_error("cannot map filename " + filename);
+			}
+			data = (const char*)ptr;
+		}
+		::close(fd);
+#endif
+	}
+
+	~MappedFile() {
+#ifndef _WIN32
+		if (data) munmap((void*)data, size);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile &operator=(const MappedFile&) = delete;
+
+#ifdef _WIN32
+	private:
+	std::vector<char> buffer;
+#endif
+};
+
+//
+// BinReader
+// Bounds checked access to the sections of a mapped binary scene.
+//
+struct BinReader {
+	const MappedFile &file;
+	std::string filename;
+
+	void check(bool ok) const {
+		if (!ok) throw std::runtime_error("invalid binary scene " + filename);
+	}
+
+	// checks that count elements of the given size fit in the file
+	void check_section(const BinSection &section, uint64_t elemSize) const {
+		check(section.offset <= file.size && (section.offset % 16) == 0);
+		check(section.count <= (file.size - section.offset) / elemSize);
+	}
+
+	template <typename T>
+	const T *records(const BinSection &section) const {
+		check_section(section, sizeof(T));
+		return (const T*)(file.data + section.offset);
+	}
+
+	template <typename T>
+	void array(const BinSection &section, std::vector<T> &dst) const {
+		check_section(section, sizeof(T));
+		auto ptr = (const T*)(file.data + section.offset);
+		dst.assign(ptr, ptr + section.count);
+	}
+};
+
+static ygl::frame3f read_frame(const float *f) {
+	auto frame = ygl::frame3f();
+	memcpy(&frame.x.x, f, sizeof(float) * 12);
+	return frame;
+}
+
+static ygl::vec3f read_vec3(const float *v) {
+	return {v[0], v[1], v[2]};
+}
+
+ygl::scene *load_binary_scene(const std::string &filename, bool loadTextures) {
+	MappedFile file(filename);
+	auto reader = BinReader{file, filename};
+	reader.check(file.size >= sizeof(BinHeader));
+	auto header = (const BinHeader*)file.data;
+	reader.check(memcmp(header->magic, binMagic, 8) == 0);
+	if (header->version != BINARY_SCENE_VERSION)
+		throw std::runtime_error("unsupported binary scene version in " + filename);
+	reader.check(header->headerSize == sizeof(BinHeader) && header->fileSize == file.size);
+
+	auto strings = reader.records<char>(header->strings);
+	auto numStrings = header->strings.count;
+	reader.check(numStrings == 0 || strings[numStrings - 1] == 0);
+	auto str = [&](uint32_t offset) {
+		reader.check(offset < numStrings);
+		return std::string(strings + offset);
+	};
+
+	auto scn = std::unique_ptr<ygl::scene>(new ygl::scene());
+	auto dirname = ygl::path_dirname(filename);
+
+	auto textures = reader.records<BinTexture>(header->textures);
+	for (uint64_t i = 0; i < header->textures.count; i++) {
+		auto txt = new ygl::texture();
+		txt->path = str(textures[i].path);
+		scn->textures.push_back(txt);
+		if (!loadTextures) continue;
+		auto path = dirname + txt->path;
+		if (textures[i].hdr) txt->hdr = ygl::load_image4f(path);
+		else txt->ldr = ygl::load_image4b(path);
+	}
+	auto texture_ref = [&](const BinTextureRef &ref, ygl::texture *&txt, ygl::texture_info *&info) {
+		if (ref.texture < 0) return;
+		reader.check(ref.texture < (int64_t)scn->textures.size());
+		txt = scn->textures[ref.texture];
+		if (!ref.hasInfo) return;
+		info = new ygl::texture_info();
+		info->wrap_s = ref.wrapS;
+		info->wrap_t = ref.wrapT;
+		info->linear = ref.linear;
+		info->mipmap = ref.mipmap;
+		info->scale = ref.scale;
+	};
+
+	auto materials = reader.records<BinMaterial>(header->materials);
+	for (uint64_t i = 0; i < header->materials.count; i++) {
+		auto &bmat = materials[i];
+		auto mat = new ygl::material();
+		scn->materials.push_back(mat);
+		mat->name = str(bmat.name);
+		mat->type = (ygl::material_type)bmat.type;
+		mat->double_sided = bmat.doubleSided;
+		mat->ke = read_vec3(bmat.ke);
+		mat->kd = read_vec3(bmat.kd);
+		mat->ks = read_vec3(bmat.ks);
+		mat->kr = read_vec3(bmat.kr);
+		mat->kt = read_vec3(bmat.kt);
+		mat->rs = bmat.rs;
+		mat->op = bmat.op;
+		texture_ref(bmat.textures[0], mat->ke_txt, mat->ke_txt_info);
+		texture_ref(bmat.textures[1], mat->kd_txt, mat->kd_txt_info);
+		texture_ref(bmat.textures[2], mat->ks_txt, mat->ks_txt_info);
+		texture_ref(bmat.textures[3], mat->kr_txt, mat->kr_txt_info);
+		texture_ref(bmat.textures[4], mat->kt_txt, mat->kt_txt_info);
+		texture_ref(bmat.textures[5], mat->rs_txt, mat->rs_txt_info);
+		texture_ref(bmat.textures[6], mat->bump_txt, mat->bump_txt_info);
+		texture_ref(bmat.textures[7], mat->disp_txt, mat->disp_txt_info);
+		texture_ref(bmat.textures[8], mat->norm_txt, mat->norm_txt_info);
+		texture_ref(bmat.textures[9], mat->occ_txt, mat->occ_txt_info);
+	}
+
+	auto groups = reader.records<BinShapeGroup>(header->shapeGroups);
+	auto shapes = reader.records<BinShape>(header->shapes);
+	for (uint64_t i = 0; i < header->shapeGroups.count; i++) {
+		auto &bsgr = groups[i];
+		auto sgr = new ygl::shape_group();
+		scn->shapes.push_back(sgr);
+		sgr->name = str(bsgr.name);
+		sgr->path = str(bsgr.path);
+		reader.check((uint64_t)bsgr.firstShape + bsgr.numShapes <= header->shapes.count);
+		for (auto j = bsgr.firstShape; j < bsgr.firstShape + bsgr.numShapes; j++) {
+			auto &bshp = shapes[j];
+			auto shp = new ygl::shape();
+			sgr->shapes.push_back(shp);
+			shp->name = str(bshp.name);
+			reader.check(bshp.material < (int64_t)scn->materials.size());
+			if (bshp.material >= 0) shp->mat = scn->materials[bshp.material];
+			shp->subdivision = bshp.subdivision;
+			shp->catmullclark = bshp.catmullclark;
+			reader.array(bshp.arrays[0], shp->points);
+			reader.array(bshp.arrays[1], shp->lines);
+			reader.array(bshp.arrays[2], shp->triangles);
+			reader.array(bshp.arrays[3], shp->quads);
+			reader.array(bshp.arrays[4], shp->quads_pos);
+			reader.array(bshp.arrays[5], shp->quads_norm);
+			reader.array(bshp.arrays[6], shp->quads_texcoord);
+			reader.array(bshp.arrays[7], shp->beziers);
+			reader.array(bshp.arrays[8], shp->pos);
+			reader.array(bshp.arrays[9], shp->norm);
+			reader.array(bshp.arrays[10], shp->texcoord);
+			reader.array(bshp.arrays[11], shp->texcoord1);
+			reader.array(bshp.arrays[12], shp->color);
+			reader.array(bshp.arrays[13], shp->radius);
+			reader.array(bshp.arrays[14], shp->tangsp);
+		}
+	}
+
+	auto instances = reader.records<BinInstance>(header->instances);
+	for (uint64_t i = 0; i < header->instances.count; i++) {
+		auto ist = new ygl::instance();
+		scn->instances.push_back(ist);
+		ist->name = str(instances[i].name);
+		ist->frame = read_frame(instances[i].frame);
+		reader.check(instances[i].shapeGroup < (int64_t)scn->shapes.size());
+		if (instances[i].shapeGroup >= 0) ist->shp = scn->shapes[instances[i].shapeGroup];
+	}
+
+	auto cameras = reader.records<BinCamera>(header->cameras);
+	for (uint64_t i = 0; i < header->cameras.count; i++) {
+		auto &bcam = cameras[i];
+		auto cam = new ygl::camera();
+		scn->cameras.push_back(cam);
+		cam->name = str(bcam.name);
+		cam->ortho = bcam.ortho;
+		cam->frame = read_frame(bcam.frame);
+		cam->yfov = bcam.yfov;
+		cam->aspect = bcam.aspect;
+		cam->focus = bcam.focus;
+		cam->aperture = bcam.aperture;
+		cam->near = bcam.near;
+		cam->far = bcam.far;
+	}
+
+	auto environments = reader.records<BinEnvironment>(header->environments);
+	for (uint64_t i = 0; i < header->environments.count; i++) {
+		auto env = new ygl::environment();
+		scn->environments.push_back(env);
+		env->name = str(environments[i].name);
+		env->frame = read_frame(environments[i].frame);
+		env->ke = read_vec3(environments[i].ke);
+		texture_ref(environments[i].keTxt, env->ke_txt, env->ke_txt_info);
+	}
+
+	return scn.release();
+}
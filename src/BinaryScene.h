@@ -0,0 +1,123 @@
+#ifndef __BINARYSCENE__
+#define __BINARYSCENE__
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "../yocto/yocto_gl.h"
+#include "OBJWriter.h"
+
+//
+// Binary scene format.
+// A little endian file made of a header, a string table and a list of
+// fixed size records for textures, materials, shape groups, shapes,
+// instances, cameras and environments, followed by the vertex and element
+// arrays of the shapes. Every section and array starts at a 16 bytes aligned
+// offset, so that the file can be mapped in memory and read in place.
+// Strings are offsets in the string table (null terminated); textures are
+// referenced by path, their images are saved next to the scene.
+//
+#define BINARY_SCENE_EXTENSION ".bscene"
+#define BINARY_SCENE_VERSION 1
+
+struct BinSection {
+	uint64_t offset = 0;
+	uint64_t count = 0;
+};
+
+struct BinHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	uint64_t fileSize;
+	BinSection strings;
+	BinSection textures;
+	BinSection materials;
+	BinSection shapeGroups;
+	BinSection shapes;
+	BinSection instances;
+	BinSection cameras;
+	BinSection environments;
+};
+
+// texture used by a material, with its texture_info (if any)
+struct BinTextureRef {
+	int32_t texture;
+	float scale;
+	uint8_t hasInfo, wrapS, wrapT, linear;
+	uint8_t mipmap, pad[3];
+};
+
+struct BinTexture {
+	uint32_t path;
+	uint32_t hdr;
+	int32_t width, height;
+};
+
+// textures in the order ke, kd, ks, kr, kt, rs, bump, disp, norm, occ
+struct BinMaterial {
+	uint32_t name;
+	uint32_t type;
+	uint32_t doubleSided;
+	float ke[3], kd[3], ks[3], kr[3], kt[3];
+	float rs, op;
+	BinTextureRef textures[10];
+};
+
+struct BinShapeGroup {
+	uint32_t name;
+	uint32_t path;
+	uint32_t firstShape;
+	uint32_t numShapes;
+};
+
+// arrays in the order of ygl::shape, from points to tangsp
+struct BinShape {
+	uint32_t name;
+	int32_t material;
+	int32_t subdivision;
+	uint32_t catmullclark;
+	BinSection arrays[15];
+};
+
+struct BinInstance {
+	uint32_t name;
+	int32_t shapeGroup;
+	float frame[12];
+};
+
+struct BinCamera {
+	uint32_t name;
+	uint32_t ortho;
+	float frame[12];
+	float yfov, aspect, focus, aperture, near, far;
+};
+
+struct BinEnvironment {
+	uint32_t name;
+	float frame[12];
+	float ke[3];
+	BinTextureRef keTxt;
+};
+
+//
+// write_binary_scene
+// Saves a scene in the binary format (and its textures, as images next to it,
+// from their pixels or textureImages, copying the source files of the
+// textures without pixels).
+//
+void write_binary_scene(const std::string &filename, const ygl::scene *scn,
+	bool saveTextures = true, bool skipMissing = true, const TextureSources *textureSources = nullptr,
+	const TextureImages *textureImages = nullptr);
+
+//
+// load_binary_scene
+// Loads a scene saved with write_binary_scene, mapping the file in memory and
+// copying its arrays in the scene shapes. Texture images are loaded when
+// loadTextures is true. Throws std::runtime_error on invalid files.
+//
+ygl::scene *load_binary_scene(const std::string &filename, bool loadTextures = true);
+
+#endif
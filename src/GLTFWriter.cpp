@@ -0,0 +1,580 @@
+#include "GLTFWriter.h"
+#include <cctype>
+
+// glTF constants
+#define GLTF_FLOAT 5126
+#define GLTF_UNSIGNED_INT 5125
+#define GLTF_ARRAY_BUFFER 34962
+#define GLTF_ELEMENT_ARRAY_BUFFER 34963
+#define GLTF_POINTS 0
+#define GLTF_LINES 1
+#define GLTF_TRIANGLES 4
+
+//
+// GLTFView
+// An array of the binary buffer, with the accessor that reads it.
+//
+struct GLTFView {
+	const void *data = nullptr;
+	uint64_t size = 0;
+	uint64_t offset = 0;
+	int target = GLTF_ARRAY_BUFFER;
+	int componentType = GLTF_FLOAT;
+	uint64_t count = 0;
+	const char *type = "SCALAR";
+	// bounds, required for positions
+	bool hasBounds = false;
+	ygl::vec3f min, max;
+};
+
+struct GLTFPrimitive {
+	int mode = GLTF_TRIANGLES;
+	int indices = -1;
+	int material = -1;
+	// accessors of POSITION, NORMAL, TEXCOORD_0, TEXCOORD_1, COLOR_0, _RADIUS
+	int attributes[6] = {-1, -1, -1, -1, -1, -1};
+};
+
+// JSON string, with escapes
+static void put_json_string(BufferedWriter &out, const std::string &s) {
+	out.put('"');
+	for (auto c : s) {
+		if (c == '"' || c == '\\') {
+			out.put('\\');
+			out.put(c);
+		}
+		else if ((unsigned char)c < 0x20) {
+			char buff[8];
+			snprintf(buff, sizeof(buff), "\\u%04x", (unsigned char)c);
+			out.put(buff, 6);
+		}
+		else out.put(c);
+	}
+	out.put('"');
+}
+
+// "key":
+static void put_json_key(BufferedWriter &out, const char *key) {
+	out.put('"');
+	out.put(key, strlen(key));
+	out.put("\":");
+}
+
+// JSON array of n floats
+static void put_json_floats(BufferedWriter &out, const float *v, int n) {
+	out.put('[');
+	for (auto i = 0; i < n; i++) {
+		if (i) out.put(',');
+		out.put_float(v[i]);
+	}
+	out.put(']');
+}
+
+// column major matrix of a frame
+static void put_json_frame(BufferedWriter &out, const ygl::frame3f &f) {
+	float m[16] = {f.x.x, f.x.y, f.x.z, 0, f.y.x, f.y.y, f.y.z, 0,
+		f.z.x, f.z.y, f.z.z, 0, f.o.x, f.o.y, f.o.z, 1};
+	put_json_floats(out, m, 16);
+}
+
+// true for the images glTF can reference, png and jpeg files
+static bool gltf_image(const std::string &path) {
+	auto ext = ygl::path_extension(path);
+	for (auto &c : ext)
+		c = (char)std::tolower((unsigned char)c);
+	return ext == ".png" || ext == ".jpg" || ext == ".jpeg";
+}
+
+//
+// GLTFTextures
+// glTF textures, samplers and images of the scene. A glTF texture is created
+// for every distinct pair of image and sampler. Textures with other images
+// (hdr and exr ones) are left out.
+//
+struct GLTFTextures {
+	std::unordered_map<const ygl::texture*, int> images;
+	std::vector<const ygl::texture*> imageList;
+	std::map<std::pair<int, int>, int> textures;
+	std::vector<std::pair<int, int>> textureList;
+	// wrapS, wrapT, minFilter, magFilter
+	std::vector<std::array<int, 4>> samplers;
+
+	int add(const ygl::texture *txt, const ygl::texture_info *info) {
+		auto sampler = -1;
+		if (info && !(info->wrap_s && info->wrap_t && info->linear && info->mipmap)) {
+			auto key = std::array<int, 4>{
+				info->wrap_s ? 10497 : 33071, info->wrap_t ? 10497 : 33071,
+				info->mipmap ? 9987 : 9728, info->linear ? 9729 : 9728};
+			auto it = std::find(samplers.begin(), samplers.end(), key);
+			sampler = (int)(it - samplers.begin());
+			if (it == samplers.end()) samplers.push_back(key);
+		}
+		auto key = std::make_pair(images.at(txt), sampler);
+		auto it = textures.find(key);
+		if (it != textures.end()) return it->second;
+		textures[key] = (int)textureList.size();
+		textureList.push_back(key);
+		return (int)textureList.size() - 1;
+	}
+};
+
+// "key":{"index":N[,"scale"/"strength":s]}, when the texture is set
+static void put_texture_info(BufferedWriter &out, GLTFTextures &textures, bool &comma, const char *key,
+	const ygl::texture *txt, const ygl::texture_info *info, const char *scaleKey = nullptr) {
+	if (!txt || !textures.images.count(txt)) return;
+	if (comma) out.put(',');
+	comma = true;
+	put_json_key(out, key);
+	out.put("{\"index\":");
+	out.put_int(textures.add(txt, info));
+	if (scaleKey && info && info->scale != 1) {
+		out.put(',');
+		put_json_key(out, scaleKey);
+		out.put_float(info->scale);
+	}
+	out.put('}');
+}
+
+// scale of an emission that does not fit in the [0, 1] emissiveFactor, 1 if it does
+static float emissive_strength(const ygl::material *mat) {
+	return std::max(1.0f, std::max(mat->ke.x, std::max(mat->ke.y, mat->ke.z)));
+}
+
+//
+// write_material
+// Converts a material as ygl::save_scene does for glTF. Specular materials use
+// KHR_materials_pbrSpecularGlossiness, with a metallic-roughness fallback.
+// Emission brighter than 1 is normalized, and scaled back with
+// KHR_materials_emissive_strength.
+//
+static void write_material(BufferedWriter &out, const ygl::material *mat, GLTFTextures &textures) {
+	auto comma = false;
+	out.put('{');
+	if (!mat->name.empty()) {
+		put_json_key(out, "name");
+		put_json_string(out, mat->name);
+		comma = true;
+	}
+	auto strength = emissive_strength(mat);
+	if (mat->ke != ygl::zero3f) {
+		auto ke = mat->ke / strength;
+		if (comma) out.put(',');
+		put_json_key(out, "emissiveFactor");
+		put_json_floats(out, &ke.x, 3);
+		comma = true;
+	}
+	put_texture_info(out, textures, comma, "emissiveTexture", mat->ke_txt, mat->ke_txt_info);
+	put_texture_info(out, textures, comma, "normalTexture", mat->norm_txt, mat->norm_txt_info, "scale");
+	put_texture_info(out, textures, comma, "occlusionTexture", mat->occ_txt, mat->occ_txt_info, "strength");
+	if (mat->double_sided) {
+		if (comma) out.put(',');
+		out.put("\"doubleSided\":true");
+		comma = true;
+	}
+
+	float color[4] = {mat->kd.x, mat->kd.y, mat->kd.z, mat->op};
+	auto metallic = (mat->type == ygl::material_type::metallic_roughness) ? mat->ks.x : 0.0f;
+	auto roughness = (mat->type == ygl::material_type::specular_glossiness) ? 1 - mat->rs : mat->rs;
+	if (comma) out.put(',');
+	put_json_key(out, "pbrMetallicRoughness");
+	out.put('{');
+	put_json_key(out, "baseColorFactor");
+	put_json_floats(out, color, 4);
+	out.put(',');
+	put_json_key(out, "metallicFactor");
+	out.put_float(metallic);
+	out.put(',');
+	put_json_key(out, "roughnessFactor");
+	out.put_float(roughness);
+	comma = true;
+	put_texture_info(out, textures, comma, "baseColorTexture", mat->kd_txt, mat->kd_txt_info);
+	if (mat->type == ygl::material_type::metallic_roughness)
+		put_texture_info(out, textures, comma, "metallicRoughnessTexture", mat->ks_txt, mat->ks_txt_info);
+	out.put('}');
+
+	auto specular = mat->type != ygl::material_type::metallic_roughness;
+	if (specular || strength > 1)
+		out.put(",\"extensions\":{");
+	if (specular) {
+		auto glossiness = (mat->type == ygl::material_type::specular_roughness) ? 1 - mat->rs : mat->rs;
+		out.put("\"KHR_materials_pbrSpecularGlossiness\":{");
+		put_json_key(out, "diffuseFactor");
+		put_json_floats(out, color, 4);
+		out.put(',');
+		put_json_key(out, "specularFactor");
+		put_json_floats(out, &mat->ks.x, 3);
+		out.put(',');
+		put_json_key(out, "glossinessFactor");
+		out.put_float(glossiness);
+		put_texture_info(out, textures, comma, "diffuseTexture", mat->kd_txt, mat->kd_txt_info);
+		put_texture_info(out, textures, comma, "specularGlossinessTexture", mat->ks_txt, mat->ks_txt_info);
+		out.put('}');
+	}
+	if (strength > 1) {
+		if (specular) out.put(',');
+		out.put("\"KHR_materials_emissive_strength\":{");
+		put_json_key(out, "emissiveStrength");
+		out.put_float(strength);
+		out.put('}');
+	}
+	if (specular || strength > 1)
+		out.put('}');
+	out.put('}');
+}
+
+// =====================================================================================
+//                           SCENE
+// =====================================================================================
+
+void write_gltf_scene(const std::string &filename, const ygl::scene *scn, const GLTFSaveOptions &opts) {
+	auto dirname = ygl::path_dirname(filename);
+	auto binName = ygl::path_basename(filename) + ".bin";
+
+	// buffer views, in the order they are stored in the binary buffer
+	auto views = std::vector<GLTFView>();
+	auto bufferSize = (uint64_t)0;
+	auto add_view = [&](const void *data, uint64_t count, uint64_t elemSize, int componentType,
+		const char *type, int target) {
+		auto view = GLTFView();
+		view.data = data;
+		view.count = count;
+		view.size = count * elemSize;
+		view.offset = bufferSize;
+		view.componentType = componentType;
+		view.type = type;
+		view.target = target;
+		bufferSize += (view.size + 3) & ~(uint64_t)3;
+		views.push_back(view);
+		return (int)views.size() - 1;
+	};
+
+	auto materialIds = std::unordered_map<const ygl::material*, int>();
+	for (auto i = 0; i < (int)scn->materials.size(); i++)
+		materialIds[scn->materials[i]] = i;
+
+	// meshes, one for each shape group, with a primitive for each kind of element of its shapes
+	auto meshes = std::vector<std::vector<GLTFPrimitive>>();
+	auto meshIds = std::unordered_map<const ygl::shape_group*, int>();
+	// triangles made from quads, alive until the buffer is written
+	auto quadTriangles = std::vector<std::unique_ptr<std::vector<ygl::vec3i>>>();
+	for (auto sgr : scn->shapes) {
+		auto primitives = std::vector<GLTFPrimitive>();
+		for (auto shp : sgr->shapes) {
+			if (!shp->quads_pos.empty())
+				throw std::runtime_error("face varying shapes are not supported in glTF (" + shp->name + ")");
+			if (shp->pos.empty()) continue;
+			auto prim = GLTFPrimitive();
+			prim.material = (shp->mat) ? materialIds.at(shp->mat) : -1;
+			prim.attributes[0] = add_view(shp->pos.data(), shp->pos.size(), sizeof(ygl::vec3f),
+				GLTF_FLOAT, "VEC3", GLTF_ARRAY_BUFFER);
+			auto &posView = views.back();
+			posView.hasBounds = true;
+			posView.min = posView.max = shp->pos[0];
+			for (auto &p : shp->pos) {
+				posView.min = ygl::vec3f{std::min(posView.min.x, p.x), std::min(posView.min.y, p.y), std::min(posView.min.z, p.z)};
+				posView.max = ygl::vec3f{std::max(posView.max.x, p.x), std::max(posView.max.y, p.y), std::max(posView.max.z, p.z)};
+			}
+			if (!shp->norm.empty())
+				prim.attributes[1] = add_view(shp->norm.data(), shp->norm.size(), sizeof(ygl::vec3f),
+					GLTF_FLOAT, "VEC3", GLTF_ARRAY_BUFFER);
+			if (!shp->texcoord.empty())
+				prim.attributes[2] = add_view(shp->texcoord.data(), shp->texcoord.size(), sizeof(ygl::vec2f),
+					GLTF_FLOAT, "VEC2", GLTF_ARRAY_BUFFER);
+			if (!shp->texcoord1.empty())
+				prim.attributes[3] = add_view(shp->texcoord1.data(), shp->texcoord1.size(), sizeof(ygl::vec2f),
+					GLTF_FLOAT, "VEC2", GLTF_ARRAY_BUFFER);
+			if (!shp->color.empty())
+				prim.attributes[4] = add_view(shp->color.data(), shp->color.size(), sizeof(ygl::vec4f),
+					GLTF_FLOAT, "VEC4", GLTF_ARRAY_BUFFER);
+			if (!shp->radius.empty())
+				prim.attributes[5] = add_view(shp->radius.data(), shp->radius.size(), sizeof(float),
+					GLTF_FLOAT, "SCALAR", GLTF_ARRAY_BUFFER);
+
+			auto add_elements = [&](const void *data, uint64_t count, int mode) {
+				if (!count) return;
+				prim.mode = mode;
+				prim.indices = add_view(data, count, sizeof(int), GLTF_UNSIGNED_INT, "SCALAR",
+					GLTF_ELEMENT_ARRAY_BUFFER);
+				primitives.push_back(prim);
+			};
+			add_elements(shp->points.data(), shp->points.size(), GLTF_POINTS);
+			add_elements(shp->lines.data(), shp->lines.size() * 2, GLTF_LINES);
+			add_elements(shp->triangles.data(), shp->triangles.size() * 3, GLTF_TRIANGLES);
+			if (!shp->quads.empty()) {
+				quadTriangles.push_back(std::unique_ptr<std::vector<ygl::vec3i>>(
+					new std::vector<ygl::vec3i>(ygl::convert_quads_to_triangles(shp->quads))));
+				add_elements(quadTriangles.back()->data(), quadTriangles.back()->size() * 3, GLTF_TRIANGLES);
+			}
+		}
+		if (primitives.empty()) continue;
+		meshIds[sgr] = (int)meshes.size();
+		meshes.push_back(primitives);
+	}
+
+	auto textures = GLTFTextures();
+	for (auto txt : scn->textures) {
+		if (!gltf_image(txt->path)) continue;
+		textures.images[txt] = (int)textures.imageList.size();
+		textures.imageList.push_back(txt);
+	}
+
+	// json
+	BufferedWriter js(1 << 20, 0);
+	js.put("{\"asset\":{\"version\":\"2.0\",\"generator\":\"PBRTParser\"}");
+
+	// nodes: instances, then cameras
+	auto numNodes = (int)scn->cameras.size();
+	for (auto ist : scn->instances)
+		numNodes += (int)meshIds.count(ist->shp);
+	if (!numNodes) throw std::runtime_error("nothing to save in " + filename);
+	js.put(",\"nodes\":[");
+	auto nodeId = 0;
+	for (auto ist : scn->instances) {
+		auto it = meshIds.find(ist->shp);
+		if (it == meshIds.end()) continue;
+		if (nodeId++) js.put(',');
+		js.put("{\"name\":");
+		put_json_string(js, ist->name);
+		js.put(",\"mesh\":");
+		js.put_int(it->second);
+		js.put(",\"matrix\":");
+		put_json_frame(js, ist->frame);
+		js.put('}');
+	}
+	for (auto i = 0; i < (int)scn->cameras.size(); i++) {
+		if (nodeId++) js.put(',');
+		js.put("{\"name\":");
+		put_json_string(js, scn->cameras[i]->name);
+		js.put(",\"camera\":");
+		js.put_int(i);
+		js.put(",\"matrix\":");
+		put_json_frame(js, scn->cameras[i]->frame);
+		js.put('}');
+	}
+	js.put(']');
+	js.put(",\"scene\":0,\"scenes\":[{\"nodes\":[");
+	for (auto i = 0; i < numNodes; i++) {
+		if (i) js.put(',');
+		js.put_int(i);
+	}
+	js.put("]}]");
+
+	if (!scn->cameras.empty()) {
+		js.put(",\"cameras\":[");
+		for (auto i = 0; i < (int)scn->cameras.size(); i++) {
+			auto cam = scn->cameras[i];
+			if (i) js.put(',');
+			js.put("{\"name\":");
+			put_json_string(js, cam->name);
+			if (cam->ortho) {
+				js.put(",\"type\":\"orthographic\",\"orthographic\":{\"xmag\":");
+				js.put_float(cam->aspect * cam->yfov);
+				js.put(",\"ymag\":");
+				js.put_float(cam->yfov);
+			}
+			else {
+				js.put(",\"type\":\"perspective\",\"perspective\":{\"yfov\":");
+				js.put_float(cam->yfov);
+				js.put(",\"aspectRatio\":");
+				js.put_float(cam->aspect);
+			}
+			js.put(",\"znear\":");
+			js.put_float(cam->near);
+			js.put(",\"zfar\":");
+			js.put_float(cam->far);
+			js.put("}}");
+		}
+		js.put(']');
+	}
+
+	if (!meshes.empty()) {
+		static const char *attributeNames[] = {"POSITION", "NORMAL", "TEXCOORD_0", "TEXCOORD_1", "COLOR_0", "_RADIUS"};
+		js.put(",\"meshes\":[");
+		auto id = 0;
+		for (auto sgr : scn->shapes) {
+			if (!meshIds.count(sgr)) continue;
+			if (id) js.put(',');
+			js.put("{\"name\":");
+			put_json_string(js, sgr->name);
+			js.put(",\"primitives\":[");
+			auto &primitives = meshes[id++];
+			for (auto p = 0; p < (int)primitives.size(); p++) {
+				auto &prim = primitives[p];
+				if (p) js.put(',');
+				js.put("{\"attributes\":{");
+				auto first = true;
+				for (auto a = 0; a < 6; a++) {
+					if (prim.attributes[a] < 0) continue;
+					if (!first) js.put(',');
+					first = false;
+					put_json_key(js, attributeNames[a]);
+					js.put_int(prim.attributes[a]);
+				}
+				js.put("},\"indices\":");
+				js.put_int(prim.indices);
+				js.put(",\"mode\":");
+				js.put_int(prim.mode);
+				if (prim.material >= 0) {
+					js.put(",\"material\":");
+					js.put_int(prim.material);
+				}
+				js.put('}');
+			}
+			js.put("]}");
+		}
+		js.put(']');
+	}
+
+	// every accessor reads the buffer view with its same index
+	if (!views.empty()) {
+		js.put(",\"accessors\":[");
+		for (auto i = 0; i < (int)views.size(); i++) {
+			auto &view = views[i];
+			if (i) js.put(',');
+			js.put("{\"bufferView\":");
+			js.put_int(i);
+			js.put(",\"componentType\":");
+			js.put_int(view.componentType);
+			js.put(",\"count\":");
+			js.put(std::to_string(view.count));
+			js.put(",\"type\":\"");
+			js.put(view.type, strlen(view.type));
+			js.put('"');
+			if (view.hasBounds) {
+				js.put(",\"min\":");
+				put_json_floats(js, &view.min.x, 3);
+				js.put(",\"max\":");
+				put_json_floats(js, &view.max.x, 3);
+			}
+			js.put('}');
+		}
+		js.put("],\"bufferViews\":[");
+		for (auto i = 0; i < (int)views.size(); i++) {
+			auto &view = views[i];
+			if (i) js.put(',');
+			js.put("{\"buffer\":0,\"byteOffset\":");
+			js.put(std::to_string(view.offset));
+			js.put(",\"byteLength\":");
+			js.put(std::to_string(view.size));
+			js.put(",\"target\":");
+			js.put_int(view.target);
+			js.put('}');
+		}
+		js.put("],\"buffers\":[{\"byteLength\":");
+		js.put(std::to_string(bufferSize));
+		if (!opts.binary) {
+			js.put(",\"uri\":");
+			put_json_string(js, binName);
+		}
+		js.put("}]");
+	}
+
+	if (!scn->materials.empty()) {
+		js.put(",\"materials\":[");
+		for (auto i = 0; i < (int)scn->materials.size(); i++) {
+			if (i) js.put(',');
+			write_material(js, scn->materials[i], textures);
+		}
+		js.put(']');
+		auto specular = false, emissive = false;
+		for (auto mat : scn->materials) {
+			specular = specular || mat->type != ygl::material_type::metallic_roughness;
+			emissive = emissive || emissive_strength(mat) > 1;
+		}
+		if (specular || emissive) {
+			js.put(",\"extensionsUsed\":[");
+			if (specular) js.put("\"KHR_materials_pbrSpecularGlossiness\"");
+			if (specular && emissive) js.put(',');
+			if (emissive) js.put("\"KHR_materials_emissive_strength\"");
+			js.put(']');
+		}
+	}
+
+	if (!textures.textureList.empty()) {
+		js.put(",\"textures\":[");
+		for (auto i = 0; i < (int)textures.textureList.size(); i++) {
+			if (i) js.put(',');
+			js.put("{\"source\":");
+			js.put_int(textures.textureList[i].first);
+			if (textures.textureList[i].second >= 0) {
+				js.put(",\"sampler\":");
+				js.put_int(textures.textureList[i].second);
+			}
+			js.put('}');
+		}
+		js.put(']');
+		if (!textures.samplers.empty()) {
+			js.put(",\"samplers\":[");
+			for (auto i = 0; i < (int)textures.samplers.size(); i++) {
+				auto &smp = textures.samplers[i];
+				if (i) js.put(',');
+				js.put("{\"wrapS\":");
+				js.put_int(smp[0]);
+				js.put(",\"wrapT\":");
+				js.put_int(smp[1]);
+				js.put(",\"minFilter\":");
+				js.put_int(smp[2]);
+				js.put(",\"magFilter\":");
+				js.put_int(smp[3]);
+				js.put('}');
+			}
+			js.put(']');
+		}
+		js.put(",\"images\":[");
+		for (auto i = 0; i < (int)textures.imageList.size(); i++) {
+			if (i) js.put(',');
+			js.put("{\"uri\":");
+			put_json_string(js, textures.imageList[i]->path);
+			js.put('}');
+		}
+		js.put(']');
+	}
+	js.put('}');
+
+	// binary buffer, with every view aligned to 4 bytes
+	static const char zeros[4] = {0, 0, 0, 0};
+	auto put_buffer = [&](BufferedWriter &out) {
+		for (auto &view : views) {
+			out.put((const char*)view.data, view.size);
+			out.put(zeros, ((view.size + 3) & ~(uint64_t)3) - view.size);
+		}
+	};
+
+	if (opts.binary) {
+		auto jsonLength = (uint32_t)((js.size() + 3) & ~(size_t)3);
+		if (bufferSize + jsonLength + 28 > 0xffffffffull)
+			throw std::runtime_error("scene too large for a glb file, save it as gltf");
+		uint32_t header[5] = {0x46546C67, 2, (uint32_t)(12 + 8 + jsonLength + (views.empty() ? 0 : 8 + bufferSize)),
+			jsonLength, 0x4E4F534A};
+		BufferedWriter out(filename, 16 << 20, 0);
+		out.put((const char*)header, sizeof(header));
+		out.put(js);
+		out.put("   ", jsonLength - js.size());
+		if (!views.empty()) {
+			uint32_t chunk[2] = {(uint32_t)bufferSize, 0x004E4942};
+			out.put((const char*)chunk, sizeof(chunk));
+			put_buffer(out);
+		}
+		out.close();
+	}
+	else {
+		BufferedWriter out(filename, 1 << 20, 0);
+		out.put(js);
+		out.close();
+		if (!views.empty()) {
+			BufferedWriter bin(dirname + binName, 16 << 20, 0);
+			put_buffer(bin);
+			bin.close();
+		}
+	}
+
+	if (opts.saveTextures) {
+		auto to = TextureSaveOptions();
+		to.skipMissing = opts.skipMissing;
+		to.fastPNG = opts.fastPNG;
+		to.sources = opts.textureSources;
+		to.linkSources = opts.linkTextures;
+		to.images = opts.textureImages;
+		write_textures(scn, dirname, to);
+	}
+}
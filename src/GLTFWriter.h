@@ -0,0 +1,38 @@
+#ifndef __GLTFWRITER__
+#define __GLTFWRITER__
+#include <string>
+#include <vector>
+#include <map>
+#include <array>
+#include <unordered_map>
+#include <cstdint>
+#include <stdexcept>
+#include "../yocto/yocto_gl.h"
+#include "OBJWriter.h"
+
+// Options used when saving glTF files.
+struct GLTFSaveOptions {
+	// single .glb file instead of .gltf + .bin
+	bool binary = false;
+	bool saveTextures = true;
+	bool skipMissing = true;
+	// faster png compression of the textures, with bigger files
+	bool fastPNG = false;
+	// files copied (or hard linked) for the textures without pixels
+	const TextureSources *textureSources = nullptr;
+	bool linkTextures = false;
+	// pixels of the textures kept with the channels they use (see reduce_texture)
+	const TextureImages *textureImages = nullptr;
+};
+
+//
+// write_gltf_scene
+// Saves a scene as glTF 2.0 (.gltf and .bin, or a single .glb), keeping its
+// instancing: every shape group becomes a mesh, written once, and every
+// instance a node referencing it. Vertex data is streamed from the shapes to
+// the binary buffer, without copies. Texture images are saved next to the file;
+// only png and jpeg ones are referenced, as glTF allows.
+//
+void write_gltf_scene(const std::string &filename, const ygl::scene *scn, const GLTFSaveOptions &opts);
+
+#endif
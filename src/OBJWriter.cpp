@@ -0,0 +1,764 @@
+#include "OBJWriter.h"
+#include <mutex>
+#include <condition_variable>
+
+// powers of ten from 1e-64 to 1e64
+struct Pow10Table {
+	double values[129];
+	Pow10Table() {
+		for (int i = 0; i < 129; i++)
+			values[i] = std::pow(10.0, i - 64);
+	}
+};
+static const Pow10Table pow10Table;
+
+static inline double pow10i(int k) {
+	return pow10Table.values[k + 64];
+}
+
+int format_int(char *buff, int v) {
+	char tmp[12];
+	auto n = 0, len = 0;
+	auto u = (unsigned int)v;
+	if (v < 0) {
+		buff[len++] = '-';
+		u = 0u - u;
+	}
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	while (n) buff[len++] = tmp[--n];
+	return len;
+}
+
+//
+// scale_pow10
+// x * 10^k, dividing by the (exact) power of ten when k is negative, so that
+// the result is correctly rounded whenever the power itself is exact.
+//
+static inline double scale_pow10(double x, int k) {
+	return (k >= 0) ? x * pow10i(k) : x / pow10i(-k);
+}
+
+//
+// round_decimal
+// Rounds x (> 0) to p significant digits, ties to even like printf:
+// x ~= d * 10^(e10 - p + 1), with 10^(p-1) <= d < 10^p.
+//
+static void round_decimal(double x, int p, long long &d, int &e10) {
+	auto lo = (long long)pow10i(p - 1), hi = (long long)pow10i(p);
+	for (int i = 0; i < 3; i++) {
+		auto y = scale_pow10(x, p - 1 - e10);
+		auto f = std::floor(y);
+		d = (long long)f;
+		if (y - f > 0.5 || (y - f == 0.5 && (d & 1))) d++;
+		if (d >= hi) e10++;
+		else if (d < lo) e10--;
+		else return;
+	}
+	// the loop always converges, this only guards against bad estimates
+	if (d >= hi) d = hi - 1;
+}
+
+int format_float(char *buff, float v, int digits) {
+	auto len = 0;
+	if (std::isnan(v)) {
+		memcpy(buff, "nan", 3);
+		return 3;
+	}
+	if (std::signbit(v)) {
+		buff[len++] = '-';
+		v = -v;
+	}
+	if (std::isinf(v)) {
+		memcpy(buff + len, "inf", 3);
+		return len + 3;
+	}
+	if (v == 0) {
+		buff[len++] = '0';
+		return len;
+	}
+
+	auto x = (double)v;
+	auto e10 = (int)std::floor(std::log10(x));
+	auto d = 0ll;
+	auto p = digits;
+	if (digits > 0) {
+		p = std::min(digits, 17);
+		round_decimal(x, p, d, e10);
+	}
+	else {
+		// shortest decimal that falls inside the rounding interval of v, the
+		// bounds included only when they are exact and v is even (like strtof)
+		auto bits = 0u;
+		memcpy(&bits, &v, 4);
+		auto even = (bits & 1) == 0;
+		auto down = (x - (double)std::nextafter(v, 0.0f)) * 0.5;
+		auto next = std::nextafter(v, INFINITY);
+		auto up = std::isinf(next) ? down : ((double)next - x) * 0.5;
+		for (p = 1; p <= 9; p++) {
+			auto e = e10;
+			round_decimal(x, p, d, e);
+			auto k = p - 1 - e;
+			auto dec = scale_pow10((double)d, -k);
+			auto err = dec - x;
+			auto bound = (err >= 0) ? up : down;
+			auto exact = k <= 0 && dec < 9007199254740992.0;
+			if (p == 9 || std::abs(err) < bound * (1 - 1e-6) ||
+				(exact && even && std::abs(err) == bound)) {
+				e10 = e;
+				break;
+			}
+		}
+	}
+
+	// digits of d, without trailing zeros
+	char dg[20];
+	auto nd = 0;
+	for (auto i = p - 1; i >= 0; i--) {
+		dg[i] = '0' + d % 10;
+		d /= 10;
+	}
+	nd = p;
+	while (nd > 1 && dg[nd - 1] == '0') nd--;
+
+	auto maxExp = (digits > 0) ? digits : 9;
+	if (e10 >= -4 && e10 < maxExp) {
+		if (e10 >= 0) {
+			for (auto i = 0; i <= e10; i++) buff[len++] = (i < nd) ? dg[i] : '0';
+			if (nd > e10 + 1) {
+				buff[len++] = '.';
+				for (auto i = e10 + 1; i < nd; i++) buff[len++] = dg[i];
+			}
+		}
+		else {
+			buff[len++] = '0';
+			buff[len++] = '.';
+			for (auto i = 0; i < -e10 - 1; i++) buff[len++] = '0';
+			for (auto i = 0; i < nd; i++) buff[len++] = dg[i];
+		}
+	}
+	else {
+		buff[len++] = dg[0];
+		if (nd > 1) {
+			buff[len++] = '.';
+			for (auto i = 1; i < nd; i++) buff[len++] = dg[i];
+		}
+		buff[len++] = 'e';
+		buff[len++] = (e10 < 0) ? '-' : '+';
+		auto ae = std::abs(e10);
+		if (ae < 10) buff[len++] = '0';
+		len += format_int(buff + len, ae);
+	}
+	return len;
+}
+
+BufferedWriter::BufferedWriter(const std::string &filename, size_t bufferSize, int digits) :
+	filename(filename), buffer(std::max(bufferSize, (size_t)4096)), digits(digits) {
+	file = fopen(filename.c_str(), "wb");
+	if (!file)
+		throw std::runtime_error("cannot open filename " + filename);
+}
+
+BufferedWriter::BufferedWriter(size_t bufferSize, int digits) :
+	buffer(std::max(bufferSize, (size_t)4096)), digits(digits) {}
+
+BufferedWriter::~BufferedWriter() {
+	// errors can not be reported here, call close() to check them
+	if (file) {
+		if (used) fwrite(buffer.data(), 1, used, file);
+		fclose(file);
+	}
+}
+
+void BufferedWriter::make_room(size_t n) {
+	if (file) flush();
+	if (used + n > buffer.size())
+		buffer.resize(std::max(buffer.size() * 2, used + n));
+}
+
+void BufferedWriter::flush() {
+	if (!file) return;
+	if (used && fwrite(buffer.data(), 1, used, file) != used)
+		throw std::runtime_error("cannot write to file " + filename);
+	used = 0;
+}
+
+void BufferedWriter::close() {
+	if (!file) return;
+	flush();
+	auto ok = fclose(file) == 0;
+	file = nullptr;
+	if (!ok)
+		throw std::runtime_error("cannot write to file " + filename);
+}
+
+void BufferedWriter::put(const char *s, size_t n) {
+	if (file && n > buffer.size()) {
+		flush();
+		if (fwrite(s, 1, n, file) != n)
+			throw std::runtime_error("cannot write to file " + filename);
+		return;
+	}
+	reserve(n);
+	memcpy(buffer.data() + used, s, n);
+	used += n;
+}
+
+// =====================================================================================
+//                           OBJ SERIALIZATION
+// =====================================================================================
+
+static void put_frame(BufferedWriter &out, const ygl::frame3f &f) {
+	out.put_floats(&f.x.x, 12);
+}
+
+// OBJ vertex (pos/texcoord/norm/color/radius), using only the indices that are active
+static void put_vertex(BufferedWriter &out, const int *vert) {
+	auto nto_write = 0;
+	for (auto i = 0; i < 5; i++)
+		if (vert[i] >= 0) nto_write = i + 1;
+	for (auto i = 0; i < nto_write; i++) {
+		if (i) out.put('/');
+		if (vert[i] >= 0) out.put_int(vert[i] + 1);
+	}
+}
+
+// OBJ vertex of the vid-th vertex of a shape
+static void put_shape_vertex(BufferedWriter &out, const ygl::shape *shp, const OBJOffsets &offset, int vid) {
+	int vert[5] = {
+		shp->pos.empty() ? -1 : offset.pos + vid,
+		shp->texcoord.empty() ? -1 : offset.texcoord + vid,
+		shp->norm.empty() ? -1 : offset.norm + vid,
+		shp->color.empty() ? -1 : offset.color + vid,
+		shp->radius.empty() ? -1 : offset.radius + vid
+	};
+	put_vertex(out, vert);
+}
+
+// an element (label is "p ", "l ", "f " or "b ") made of n vertices of a shape
+static void put_element(BufferedWriter &out, const char *label, const ygl::shape *shp,
+	const OBJOffsets &offset, const int *vids, int n) {
+	out.put(label, 2);
+	for (auto i = 0; i < n; i++) {
+		if (i) out.put(' ');
+		put_shape_vertex(out, shp, offset, vids[i]);
+	}
+	out.put('\n');
+}
+
+// parts of the OBJ text of a shape, in the order they are written
+enum struct OBJSection {
+	group, pos, texcoord, norm, color, radius, header,
+	points, lines, triangles, quads, quadsPos, beziers
+};
+
+//
+// OBJChunk
+// A range [begin, end) of the elements of one section of a shape, whose text
+// can be formatted independently from the rest of the file.
+//
+struct OBJChunk {
+	const ygl::shape_group *sgr = nullptr;
+	const ygl::shape *shp = nullptr;
+	OBJSection section = OBJSection::group;
+	int begin = 0, end = 0;
+	OBJOffsets offset;
+};
+
+// elements per chunk
+static const int objChunkSize = 1 << 14;
+
+//
+// add_obj_chunks
+// Splits the text of a shape group in chunks, in file order, appending them to
+// chunks and computing the index offsets of every shape as a prefix sum of the
+// sizes of the previous ones, starting from offset (that is then advanced past
+// the group).
+//
+static void add_obj_chunks(std::vector<OBJChunk> &chunks, const ygl::shape_group *sgr, OBJOffsets &offset) {
+	auto add = [&](const ygl::shape_group *sgr, const ygl::shape *shp, OBJSection section, int count) {
+		for (auto begin = 0; begin < count; begin += objChunkSize) {
+			auto chunk = OBJChunk();
+			chunk.sgr = sgr;
+			chunk.shp = shp;
+			chunk.section = section;
+			chunk.begin = begin;
+			chunk.end = std::min(count, begin + objChunkSize);
+			chunk.offset = offset;
+			chunks.push_back(chunk);
+		}
+	};
+	add(sgr, nullptr, OBJSection::group, 1);
+	for (auto shp : sgr->shapes) {
+		add(sgr, shp, OBJSection::pos, (int)shp->pos.size());
+		add(sgr, shp, OBJSection::texcoord, (int)shp->texcoord.size());
+		add(sgr, shp, OBJSection::norm, (int)shp->norm.size());
+		add(sgr, shp, OBJSection::color, (int)shp->color.size());
+		add(sgr, shp, OBJSection::radius, (int)shp->radius.size());
+		add(sgr, shp, OBJSection::header, 1);
+		add(sgr, shp, OBJSection::points, (int)shp->points.size());
+		add(sgr, shp, OBJSection::lines, (int)shp->lines.size());
+		add(sgr, shp, OBJSection::triangles, (int)shp->triangles.size());
+		add(sgr, shp, OBJSection::quads, (int)shp->quads.size());
+		add(sgr, shp, OBJSection::quadsPos, (int)shp->quads_pos.size());
+		add(sgr, shp, OBJSection::beziers, (int)shp->beziers.size());
+		offset.pos += (int)shp->pos.size();
+		offset.texcoord += (int)shp->texcoord.size();
+		offset.norm += (int)shp->norm.size();
+		offset.color += (int)shp->color.size();
+		offset.radius += (int)shp->radius.size();
+	}
+}
+
+// writes the text of a chunk
+static void write_chunk(BufferedWriter &out, const OBJChunk &chunk, bool flipTexcoord) {
+	auto shp = chunk.shp;
+	auto &offset = chunk.offset;
+	switch (chunk.section) {
+		case OBJSection::group:
+			out.put("o ", 2);
+			out.put(chunk.sgr->name);
+			out.put('\n');
+			break;
+		case OBJSection::pos:
+			for (auto i = chunk.begin; i < chunk.end; i++) {
+				out.put("v ", 2);
+				out.put_floats(&shp->pos[i].x, 3);
+				out.put('\n');
+			}
+			break;
+		case OBJSection::texcoord:
+			for (auto i = chunk.begin; i < chunk.end; i++) {
+				auto &v = shp->texcoord[i];
+				out.put("vt ", 3);
+				out.put_float(v.x);
+				out.put(' ');
+				out.put_float(flipTexcoord ? 1 - v.y : v.y);
+				out.put('\n');
+			}
+			break;
+		case OBJSection::norm:
+			for (auto i = chunk.begin; i < chunk.end; i++) {
+				out.put("vn ", 3);
+				out.put_floats(&shp->norm[i].x, 3);
+				out.put('\n');
+			}
+			break;
+		case OBJSection::color:
+			for (auto i = chunk.begin; i < chunk.end; i++) {
+				out.put("vc ", 3);
+				out.put_floats(&shp->color[i].x, 4);
+				out.put('\n');
+			}
+			break;
+		case OBJSection::radius:
+			for (auto i = chunk.begin; i < chunk.end; i++) {
+				out.put("vr ", 3);
+				out.put_float(shp->radius[i]);
+				out.put('\n');
+			}
+			break;
+		case OBJSection::header:
+			if (shp->mat) {
+				out.put("usemtl ", 7);
+				out.put(shp->mat->name);
+				out.put('\n');
+			}
+			if (!shp->name.empty()) {
+				out.put("g ", 2);
+				out.put(shp->name);
+				out.put('\n');
+			}
+			if (shp->subdivision) {
+				out.put("gp subdivision ", 15);
+				out.put_int(shp->subdivision);
+				out.put('\n');
+			}
+			if (shp->catmullclark) out.put("gp catmullclark 1\n", 18);
+			break;
+		case OBJSection::points:
+			for (auto i = chunk.begin; i < chunk.end; i++)
+				put_element(out, "p ", shp, offset, &shp->points[i], 1);
+			break;
+		case OBJSection::lines:
+			for (auto i = chunk.begin; i < chunk.end; i++)
+				put_element(out, "l ", shp, offset, &shp->lines[i].x, 2);
+			break;
+		case OBJSection::triangles:
+			for (auto i = chunk.begin; i < chunk.end; i++)
+				put_element(out, "f ", shp, offset, &shp->triangles[i].x, 3);
+			break;
+		case OBJSection::quads:
+			for (auto i = chunk.begin; i < chunk.end; i++) {
+				auto &quad = shp->quads[i];
+				put_element(out, "f ", shp, offset, &quad.x, (quad.z == quad.w) ? 3 : 4);
+			}
+			break;
+		case OBJSection::quadsPos:
+			for (auto fid = chunk.begin; fid < chunk.end; fid++) {
+				out.put("f ", 2);
+				auto last_vid = -1;
+				for (auto i = 0; i < 4; i++) {
+					if (last_vid == shp->quads_pos[fid][i]) continue;
+					int vert[5] = {-1, -1, -1, -1, -1};
+					if (!shp->pos.empty()) vert[0] = offset.pos + shp->quads_pos[fid][i];
+					if (!shp->texcoord.empty() && !shp->quads_texcoord.empty())
+						vert[1] = offset.texcoord + shp->quads_texcoord[fid][i];
+					if (!shp->norm.empty() && !shp->quads_norm.empty())
+						vert[2] = offset.norm + shp->quads_norm[fid][i];
+					if (i) out.put(' ');
+					put_vertex(out, vert);
+					last_vid = shp->quads_pos[fid][i];
+				}
+				out.put('\n');
+			}
+			break;
+		case OBJSection::beziers:
+			for (auto i = chunk.begin; i < chunk.end; i++)
+				put_element(out, "b ", shp, offset, &shp->beziers[i].x, 4);
+			break;
+	}
+}
+
+// elements formatted on the calling thread, without the workers
+static const int objParallelSize = 1 << 16;
+
+//
+// OBJFormatter
+// Formats chunks in parallel: consecutive chunks are grouped in runs of about
+// objChunkSize elements (across shapes, so that many small shapes do not make
+// many tiny tasks), and every round formats one run per buffer, that are then
+// written to out in order, so the text is the same that a single thread would
+// produce. The worker threads and their buffers are created the first time
+// they are needed and kept until the formatter is destroyed; the calling
+// thread formats runs too. Less than objParallelSize elements, as most shapes
+// streamed one at a time, are formatted directly in out, reusing the memory
+// of the chunks.
+//
+class OBJFormatter {
+	int nthreads;
+	bool flipTexcoord;
+	int digits;
+	std::vector<std::unique_ptr<BufferedWriter>> buffers;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable started, finished;
+	// chunks being formatted, the boundaries of all their runs, and the runs
+	// of the current round: chunks [runs[i], runs[i + 1])
+	std::vector<OBJChunk> chunks;
+	std::vector<int> bounds, runs;
+	int round = 0, nextRun = 0, pending = 0;
+	bool stopping = false;
+
+	// formats the runs of the current round, until there are none left
+	void format_runs() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (nextRun + 1 < (int)runs.size()) {
+			auto i = nextRun++;
+			lock.unlock();
+			auto &buffer = *buffers[i];
+			buffer.clear();
+			for (auto c = runs[i]; c < runs[i + 1]; c++)
+				write_chunk(buffer, chunks[c], flipTexcoord);
+			lock.lock();
+			if (--pending == 0)
+				finished.notify_all();
+		}
+	}
+
+	void work() {
+		auto seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				started.wait(lock, [&]() { return stopping || round != seen; });
+				if (stopping) return;
+				seen = round;
+			}
+			format_runs();
+		}
+	}
+
+	public:
+	OBJFormatter(const OBJSaveOptions &opts) :
+		nthreads((opts.threads > 0) ? opts.threads : (int)std::thread::hardware_concurrency()),
+		flipTexcoord(opts.flipTexcoord), digits(opts.digits) {}
+
+	~OBJFormatter() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		started.notify_all();
+		for (auto &worker : workers) worker.join();
+	}
+
+	// writes count shape groups, advancing offset past them
+	void write(BufferedWriter &out, const ygl::shape_group *const *groups, int count, OBJOffsets &offset) {
+		chunks.clear();
+		for (auto g = 0; g < count; g++)
+			add_obj_chunks(chunks, groups[g], offset);
+
+		auto total = 0;
+		for (auto &chunk : chunks)
+			total += std::max(1, chunk.end - chunk.begin);
+		if (nthreads <= 1 || total < objParallelSize) {
+			for (auto &chunk : chunks) write_chunk(out, chunk, flipTexcoord);
+			return;
+		}
+
+		// run boundaries
+		bounds.assign(1, 0);
+		auto size = 0;
+		for (auto c = 0; c < (int)chunks.size(); c++) {
+			size += std::max(1, chunks[c].end - chunks[c].begin);
+			if (size >= objChunkSize || c + 1 == (int)chunks.size()) {
+				bounds.push_back(c + 1);
+				size = 0;
+			}
+		}
+
+		auto window = nthreads * 4;
+		while ((int)buffers.size() < window)
+			buffers.push_back(std::unique_ptr<BufferedWriter>(new BufferedWriter(1 << 20, digits)));
+		while ((int)workers.size() < nthreads - 1)
+			workers.push_back(std::thread([this]() { work(); }));
+		auto nruns = (int)bounds.size() - 1;
+		for (auto first = 0; first < nruns; first += window) {
+			auto nround = std::min(window, nruns - first);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				runs.assign(bounds.begin() + first, bounds.begin() + first + nround + 1);
+				nextRun = 0;
+				pending = nround;
+				round++;
+			}
+			started.notify_all();
+			format_runs();
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				finished.wait(lock, [&]() { return pending == 0; });
+			}
+			for (auto i = 0; i < nround; i++) out.put(*buffers[i]);
+		}
+	}
+};
+
+// a texture map line of the MTL, skipped when there is no texture
+static void put_texture_info(BufferedWriter &out, const char *key, const ygl::texture *txt,
+	const ygl::texture_info *info) {
+	if (!txt || txt->path.empty()) return;
+	out.put(key, strlen(key));
+	if (info && !info->wrap_s && !info->wrap_t) out.put("-clamp on ", 10);
+	out.put(txt->path);
+	out.put('\n');
+}
+
+static void put_color(BufferedWriter &out, const char *key, const ygl::vec3f &c) {
+	if (c == ygl::zero3f) return;
+	out.put(key, strlen(key));
+	out.put_floats(&c.x, 3);
+	out.put('\n');
+}
+
+static void put_value(BufferedWriter &out, const char *key, float v) {
+	out.put(key, strlen(key));
+	out.put_float(v);
+	out.put('\n');
+}
+
+//
+// write_material
+// Writes a material in MTL format, converting it as ygl::save_scene does.
+//
+static void write_material(BufferedWriter &out, const ygl::material *mat) {
+	auto kd = ygl::zero3f, ks = ygl::zero3f, kr = ygl::zero3f, kt = ygl::zero3f;
+	auto ns = 1.0f;
+	const ygl::texture *kdTxt = nullptr, *ksTxt = nullptr, *krTxt = nullptr, *ktTxt = nullptr;
+	switch (mat->type) {
+		case ygl::material_type::specular_roughness:
+			kd = mat->kd;
+			ks = mat->ks;
+			kr = mat->kr;
+			kt = mat->kt;
+			ns = (mat->rs) ? 2 / pow(mat->rs, 4.0f) - 2 : 1e6;
+			kdTxt = mat->kd_txt;
+			ksTxt = mat->ks_txt;
+			krTxt = mat->kr_txt;
+			ktTxt = mat->kt_txt;
+			break;
+		case ygl::material_type::metallic_roughness:
+			if (mat->rs == 1 && mat->ks.x == 0) {
+				kd = mat->kd;
+			}
+			else {
+				kd = mat->kd * (1 - 0.04f) * (1 - mat->ks.x);
+				ks = mat->kd * mat->ks.x + ygl::vec3f{0.04f, 0.04f, 0.04f} * (1 - mat->ks.x);
+				ns = (mat->rs) ? 2 / pow(mat->rs, 4.0f) - 2 : 1e6;
+			}
+			if (mat->ks.x < 0.5f) kdTxt = mat->kd_txt;
+			else ksTxt = mat->ks_txt;
+			break;
+		case ygl::material_type::specular_glossiness:
+			kd = mat->kd;
+			ks = mat->ks;
+			ns = (mat->rs) ? 2 / pow(1 - mat->rs, 4.0f) - 2 : 1e6;
+			kdTxt = mat->kd_txt;
+			ksTxt = mat->ks_txt;
+			break;
+	}
+
+	out.put("newmtl ", 7);
+	out.put(mat->name);
+	out.put("\n  illum ", 9);
+	out.put_int((mat->op < 1 || mat->kt != ygl::zero3f) ? 4 : 2);
+	out.put('\n');
+	put_color(out, "  Ke ", mat->ke);
+	put_color(out, "  Kd ", kd);
+	put_color(out, "  Ks ", ks);
+	put_color(out, "  Kr ", kr);
+	put_color(out, "  Kt ", kt);
+	put_color(out, "  Tf ", kt);
+	if (ns != 0.0f) put_value(out, "  Ns ", ns);
+	if (mat->op != 1.0f) put_value(out, "  d ", mat->op);
+	put_value(out, "  Ni ", 1);
+	put_texture_info(out, "  map_Ke ", mat->ke_txt, mat->ke_txt_info);
+	put_texture_info(out, "  map_Kd ", kdTxt, (kdTxt) ? mat->kd_txt_info : nullptr);
+	put_texture_info(out, "  map_Ks ", ksTxt, (ksTxt) ? mat->ks_txt_info : nullptr);
+	put_texture_info(out, "  map_Kr ", krTxt, (krTxt) ? mat->kr_txt_info : nullptr);
+	put_texture_info(out, "  map_Kt ", ktTxt, (ktTxt) ? mat->kt_txt_info : nullptr);
+	put_texture_info(out, "  map_bump ", mat->bump_txt, mat->bump_txt_info);
+	put_texture_info(out, "  map_disp ", mat->disp_txt, mat->disp_txt_info);
+	put_texture_info(out, "  map_norm ", mat->norm_txt, mat->norm_txt_info);
+	out.put('\n');
+}
+
+//
+// write_mtl
+// Writes the materials of the scene, followed by the ones of the environments.
+//
+static void write_mtl(const std::string &filename, const ygl::scene *scn, const OBJSaveOptions &opts) {
+	BufferedWriter out(filename, std::min(opts.bufferSize, (size_t)(1 << 20)), opts.digits);
+	for (auto mat : scn->materials) write_material(out, mat);
+	for (auto env : scn->environments) {
+		out.put("newmtl ", 7);
+		out.put(env->name);
+		out.put("_mat\n  illum 0\n", 15);
+		put_color(out, "  Ke ", env->ke);
+		put_value(out, "  Ns ", 1);
+		put_value(out, "  Ni ", 1);
+		put_texture_info(out, "  map_Ke ", env->ke_txt, env->ke_txt_info);
+		out.put('\n');
+	}
+	out.close();
+}
+
+static TextureSaveOptions texture_options(const OBJSaveOptions &opts) {
+	auto to = TextureSaveOptions();
+	to.skipMissing = opts.skipMissing;
+	to.fastPNG = opts.fastPNG;
+	to.threads = opts.threads;
+	to.sources = opts.textureSources;
+	to.linkSources = opts.linkTextures;
+	to.images = opts.textureImages;
+	return to;
+}
+
+// n line of an instance
+static void put_instance(BufferedWriter &out, const ygl::instance *ist) {
+	out.put("n ");
+	out.put(ist->name);
+	out.put(" \"\" \"\" ");
+	out.put((ist->shp) ? ist->shp->name : "<undefined>");
+	out.put(" \"\" ");
+	put_frame(out, ist->frame);
+	// translation, rotation and scaling are not used by instances
+	out.put(" 0 0 0 0 0 0 1 1 1 1\n");
+}
+
+OBJStreamWriter::OBJStreamWriter(const std::string &filename, const OBJSaveOptions &opts) :
+	opts(opts), out(filename, opts.bufferSize, opts.digits), formatter(new OBJFormatter(opts)) {
+	dirname = ygl::path_dirname(filename);
+	basename = filename.substr(dirname.length());
+	basename = basename.substr(0, basename.length() - 4);
+}
+
+OBJStreamWriter::~OBJStreamWriter() {}
+
+void OBJStreamWriter::begin(const ygl::scene *scn, bool streaming) {
+	if (started) return;
+	started = true;
+	// linkup to mtl (while streaming materials and environments might still come)
+	hasMtl = streaming || !scn->materials.empty() || !scn->environments.empty();
+	if (hasMtl) {
+		out.put("mtllib ");
+		out.put(basename);
+		out.put(".mtl\n");
+	}
+}
+
+void OBJStreamWriter::add_shape(const ygl::scene *scn, const ygl::shape_group *sg, const ygl::instance *inst) {
+	begin(scn, true);
+	put_instance(out, inst);
+	formatter->write(out, &sg, 1, offset);
+	written.insert(sg);
+}
+
+bool OBJStreamWriter::save_texture(const ygl::texture *txt) {
+	if (!opts.saveTextures) return false;
+	auto error = std::string();
+	if (!write_texture(txt, dirname, texture_options(opts), &error)) {
+		if (opts.skipMissing) return false;
+		throw std::runtime_error("cannot save image " + dirname + txt->path + (error.empty() ? "" : ": " + error));
+	}
+	return true;
+}
+
+void OBJStreamWriter::finish(const ygl::scene *scn) {
+	begin(scn, false);
+
+	for (auto cam : scn->cameras) {
+		out.put("c ");
+		out.put(cam->name);
+		out.put(' ');
+		out.put_int(cam->ortho);
+		out.put(' ');
+		float values[] = {cam->yfov, cam->aspect, cam->aperture, cam->focus};
+		out.put_floats(values, 4);
+		out.put(' ');
+		put_frame(out, cam->frame);
+		out.put('\n');
+	}
+
+	for (auto env : scn->environments) {
+		out.put("e ");
+		out.put(env->name);
+		out.put(' ');
+		out.put(env->name);
+		out.put("_mat ");
+		put_frame(out, env->frame);
+		out.put('\n');
+	}
+
+	for (auto ist : scn->instances)
+		if (!written.count(ist->shp)) put_instance(out, ist);
+
+	// every shape writes its own vertices, followed by its elements
+	auto groups = std::vector<const ygl::shape_group*>();
+	for (auto sgr : scn->shapes)
+		if (!written.count(sgr)) groups.push_back(sgr);
+	formatter->write(out, groups.data(), (int)groups.size(), offset);
+	out.close();
+
+	if (hasMtl)
+		write_mtl(dirname + basename + ".mtl", scn, opts);
+	if (opts.saveTextures)
+		write_textures(scn, dirname, texture_options(opts));
+}
+
+void write_obj_scene(const std::string &filename, const ygl::scene *scn, const OBJSaveOptions &opts) {
+	OBJStreamWriter writer(filename, opts);
+	writer.finish(scn);
+}
@@ -0,0 +1,180 @@
+#ifndef __OBJWRITER__
+#define __OBJWRITER__
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+#include <unordered_set>
+#include <stdexcept>
+#include "../yocto/yocto_gl.h"
+#include "utils.h"
+#include "TextureWriter.h"
+#include "ShapeSink.h"
+
+//
+// format_float
+// Writes v in buff (at least 32 chars long) and returns the number of characters
+// written. With digits == 0 writes the shortest number that reads back as v,
+// otherwise rounds v to the given number of significant digits (like "%g").
+//
+int format_float(char *buff, float v, int digits = 0);
+
+//
+// format_int
+// Writes v in buff (at least 12 chars long) and returns the number of characters written.
+//
+int format_int(char *buff, int v);
+
+//
+// BufferedWriter
+// Accumulates text in a large buffer, that is written to file in big chunks.
+// Throws std::runtime_error when the file cannot be opened or written.
+// Without a file the buffer just grows, to format text in memory.
+//
+class BufferedWriter {
+	FILE *file = nullptr;
+	std::string filename;
+	std::vector<char> buffer;
+	size_t used = 0;
+
+	// flushes the buffer, or grows it when there is no file
+	void make_room(size_t n);
+
+	// make room for n characters
+	inline void reserve(size_t n) {
+		if (used + n > buffer.size())
+			make_room(n);
+	}
+
+	public:
+	// significant digits of floats, 0 for the shortest round trip representation
+	int digits = 0;
+
+	BufferedWriter(const std::string &filename, size_t bufferSize, int digits);
+	// in memory only
+	BufferedWriter(size_t bufferSize, int digits);
+	~BufferedWriter();
+	BufferedWriter(const BufferedWriter&) = delete;
+	BufferedWriter &operator=(const BufferedWriter&) = delete;
+
+	// writes the buffered text to file
+	void flush();
+	// flushes and closes the file
+	void close();
+
+	inline const char *data() const {
+		return buffer.data();
+	}
+	inline size_t size() const {
+		return used;
+	}
+	inline void clear() {
+		used = 0;
+	}
+
+	inline void put(char c) {
+		reserve(1);
+		buffer[used++] = c;
+	}
+	void put(const char *s, size_t n);
+	inline void put(const std::string &s) {
+		put(s.data(), s.size());
+	}
+	// string literals
+	template <size_t N>
+	inline void put(const char (&s)[N]) {
+		put(s, N - 1);
+	}
+	inline void put(const BufferedWriter &other) {
+		put(other.data(), other.size());
+	}
+	inline void put_int(int v) {
+		reserve(12);
+		used += format_int(buffer.data() + used, v);
+	}
+	inline void put_float(float v) {
+		reserve(32);
+		used += format_float(buffer.data() + used, v, digits);
+	}
+	// n floats separated by spaces
+	inline void put_floats(const float *v, int n) {
+		for (int i = 0; i < n; i++) {
+			if (i) put(' ');
+			put_float(v[i]);
+		}
+	}
+};
+
+// Options used when saving OBJ files.
+struct OBJSaveOptions {
+	// significant digits of floats, 0 for the shortest round trip representation
+	int digits = 0;
+	// size of the output buffer in bytes
+	size_t bufferSize = 16 << 20;
+	bool saveTextures = true;
+	bool skipMissing = true;
+	bool flipTexcoord = true;
+	// faster png compression of the textures, with bigger files
+	bool fastPNG = false;
+	// files copied (or hard linked) for the textures without pixels
+	const TextureSources *textureSources = nullptr;
+	bool linkTextures = false;
+	// pixels of the textures kept with the channels they use (see reduce_texture)
+	const TextureImages *textureImages = nullptr;
+	// threads formatting the OBJ and encoding the textures, 0 to use all the cores
+	int threads = 0;
+};
+
+//
+// OBJOffsets
+// Number of vertex elements (v, vt, vn, vc, vr) written before a shape, that is
+// the offsets of its indices in the OBJ file.
+//
+struct OBJOffsets {
+	int pos = 0, texcoord = 0, norm = 0, color = 0, radius = 0;
+};
+
+// formats the OBJ text in parallel (defined in OBJWriter.cpp)
+class OBJFormatter;
+
+//
+// OBJStreamWriter
+// Writes the OBJ while the scene is being parsed: every shape received by
+// add_shape is written (with the node of its instance) immediately, as well as
+// the images of the textures received by save_texture; finish writes all the
+// rest, then the MTL and the textures still in memory. Small shapes are
+// formatted on the calling thread, only big ones use the formatting threads.
+//
+class OBJStreamWriter : public ShapeSink {
+	OBJSaveOptions opts;
+	BufferedWriter out;
+	std::string dirname, basename;
+	bool started = false, hasMtl = false;
+	OBJOffsets offset;
+	std::unordered_set<const ygl::shape_group*> written;
+	std::unique_ptr<OBJFormatter> formatter;
+
+	// writes the mtllib line, the first time
+	void begin(const ygl::scene *scn, bool streaming);
+
+	public:
+	OBJStreamWriter(const std::string &filename, const OBJSaveOptions &opts);
+	~OBJStreamWriter() override;
+	void add_shape(const ygl::scene *scn, const ygl::shape_group *sg, const ygl::instance *inst) override;
+	bool save_texture(const ygl::texture *txt) override;
+	void finish(const ygl::scene *scn) override;
+};
+
+//
+// write_obj_scene
+// Saves a scene as OBJ and MTL (and its textures) through BufferedWriter,
+// replacing ygl::save_scene for OBJ output. The OBJ text is formatted in
+// parallel (see OBJFormatter), in chunks that are written in scene order: the
+// output does not depend on the number of threads.
+//
+void write_obj_scene(const std::string &filename, const ygl::scene *scn, const OBJSaveOptions &opts);
+
+#endif
@@ -15,6 +15,10 @@ ygl::scene *PBRTParser::parse() {
 	this->advance();
 	this->execute_preworld_directives();
 	this->execute_world_directives();
+	this->finalize_textures();
+	// streamed shapes have been emptied, they would all look the same
+	if (!sink && mergeDuplicates)
+		merge_duplicate_shapes(scn);
 	return scn;
 }
 
@@ -64,6 +68,13 @@ void PBRTParser::fill_parameter_to_type_mapping() {
 	parameterToType.insert(MP("indices", { "integer" }));
 	parameterToType.insert(MP("P", { "point3" }));
 	parameterToType.insert(MP("uv", { "float" }));
+	// sphere, disk, cylinder
+	parameterToType.insert(MP("radius", { "float" }));
+	parameterToType.insert(MP("innerradius", { "float" }));
+	parameterToType.insert(MP("height", { "float" }));
+	parameterToType.insert(MP("zmin", { "float" }));
+	parameterToType.insert(MP("zmax", { "float" }));
+	parameterToType.insert(MP("phimax", { "float" }));
 	// lights
 	parameterToType.insert(MP("scale", { "spectrum", "rgb", "float" }));
 	parameterToType.insert(MP("L", { "spectrum", "rgb", "blackbody" }));
@@ -385,13 +396,14 @@ std::shared_ptr<PBRTParameter> PBRTParser::parse_parameter(){
 		par->value = (void *)vectors;
 	}
 	else if (par->type == "spectrum") {
-		// spectrum data can be given using a file or directly as list
-		std::vector<ygl::vec2f> samples;
+		// spectrum data can be given using a file (or a built-in name) or directly as list
+		ygl::vec3f rgb;
 		if (this->current_token().type == LexemeType::STRING) {
 			// filename given
-			std::string fname = this->current_path() + "/" + this->current_token().value;
+			auto name = this->current_token().value;
+			std::string fname = this->current_path() + "/" + name;
 			this->advance();
-			if (!load_spectrum_from_file(fname, samples))
+			if (!named_spectrum_to_rgb(name, rgb) && !spectrum_file_to_rgb(fname, rgb))
 				throw_syntax_exception("Error loading spectrum data from file.");
 		}else {
 			// step 1: read raw data
@@ -400,16 +412,19 @@ std::shared_ptr<PBRTParameter> PBRTParser::parse_parameter(){
 			// step 2: pack it in list of vec2f (lambda, val)
 			if (vals->size() % 2 != 0)
 				throw_syntax_exception("Wrong number of values given.");
+			std::vector<ygl::vec2f> samples;
 			int count = 0;
 			while (count < vals->size()) {
 				auto lamb = vals->at(count++);
 				auto v = vals->at(count++);
 				samples.push_back({ lamb, v });
 			}
+			// step 3: convert to rgb
+			rgb = spectrum_to_rgb(samples);
 		}
-		// step 3: convert to rgb and store in a vector (because it simplifies interface to get data)
+		// store in a vector (because it simplifies interface to get data)
 		std::vector<ygl::vec3f> *data = new std::vector<ygl::vec3f>();
-		data->push_back(spectrum_to_rgb(samples));
+		data->push_back(rgb);
 		par->value = (void *)data;
 		par->type = std::string("rgb");
 	}
@@ -811,10 +826,6 @@ void PBRTParser::parse_trianglemesh(ygl::shape *shp) {
 	// Single material parameters (e.g. Kd, Ks) can be directly specified on a shape
 	// overriding (for this shape) the value of the current material in the graphical state.
 
-	// TODO: solve problem with normals
-	if (shp->norm.size() == 0);
-		my_compute_normals(shp->triangles, shp->pos, shp->norm, true);
-
 	if (!(indicesCheck && PCheck)) {
 		delete shp;
 		throw_syntax_exception("Missing indices or positions in triangle mesh specification.");
@@ -839,48 +850,41 @@ void PBRTParser::execute_Shape() {
 	if (!gState.mat) {
 		// since no material was defined, empty material is created
 		warning_message("No material defined for this shape. Empty material created..");
-		ygl::material *nM = new ygl::material();
-		nM->name = get_unique_id(CounterID::material);
-		shp->mat = nM;
-		scn->materials.push_back(nM);
-	}
-	else {
-		if (!gState.mat->addedInScene) {
-			gState.mat->addedInScene = true;
-			scn->materials.push_back(gState.mat->mat);
-		}
-		shp->mat = gState.mat->mat;
+		std::shared_ptr<DeclaredMaterial> dmat(new DeclaredMaterial(new ygl::material()));
+		gState.mat = canonical_material(dmat);
 	}
 	// TODO: handle when shapes override some material properties
 
 	if (this->gState.areaLight.active) {
-		shp->mat->ke = gState.areaLight.L;
-		shp->mat->double_sided = gState.areaLight.twosided;
+		// emitting shapes use a copy of the current material, since the
+		// material itself might be shared with other shapes.
+		std::shared_ptr<DeclaredMaterial> lmat(new DeclaredMaterial(copy_material(gState.mat->mat)));
+		lmat->mat->ke = gState.areaLight.L;
+		lmat->mat->double_sided = gState.areaLight.twosided;
+		lmat = canonical_material(lmat);
+		shp->mat = add_material_to_scene(lmat);
+	}
+	else {
+		shp->mat = add_material_to_scene(gState.mat);
 	}
 
-	else if (shapeName == "trianglemesh")
+	if (shapeName == "trianglemesh")
 		this->parse_trianglemesh(shp);
 
 	else if (shapeName == "cube")
 		this->parse_cube(shp);
 	
-	else if (shapeName == "sphere") {
-		std::vector<std::shared_ptr<PBRTParameter>> params;
-		this->parse_parameters(params);
-		float radius = 1;
-		int i_rad = find_param("radius", params);
-		if (i_rad >= 0) {
-			radius = params[i_rad]->get_first_value<float>();
+	else if (shapeName == "sphere" || shapeName == "disk" || shapeName == "cylinder") {
+		UnitShape us;
+		this->parse_unit_shape(shapeName, us);
+		if (!this->inObjectDefinition) {
+			this->instance_unit_shape(shp, us);
+			return;
 		}
-		ygl::make_uvspherizedcube(shp->quads, shp->pos, shp->norm, shp->texcoord, 4, radius);
-	}
-
-	else if (shapeName == "disk") {
-		this->ignore_current_directive();
-		shp->pos.push_back({ 5, 0, 5 }); shp->pos.push_back({ -5, 0, 5 }); 
-		shp->pos.push_back({ -5, 0, -5 }); shp->pos.push_back({ 5, 0, -5 });
-		shp->quads.push_back({ 0, 1, 2, 3 });
-		
+		// shapes inside an object share the object transformation, so the
+		// size of the shape is baked in its vertices.
+		this->make_unit_shape(shp, us);
+		transform_shape(shp, ygl::frame_to_mat(us.frame));
 	}
 	else if (shapeName == "plymesh"){
 		std::shared_ptr<PBRTParameter> par = this->parse_parameter();
@@ -908,11 +912,16 @@ void PBRTParser::execute_Shape() {
 		return;
 	}
 
-	// handle texture coordinate scaling
-	for (int i = 0; i < shp->texcoord.size(); i++) {
-		shp->texcoord[i].x *= gState.uscale;
-		shp->texcoord[i].y *= gState.vscale;
-	}
+	// before the normals, so that meshes without them are welded on positions
+	// and texture coordinates (normals in the file are kept apart)
+	if (weldTolerance >= 0)
+		weld_vertices(shp, weldTolerance, std::min(weldTolerance, 1e-4f));
+
+	// pbrt meshes (inline or ply) might come without normals
+	if (shp->norm.empty() && !shp->triangles.empty())
+		compute_vertex_normals(shp->triangles, shp->pos, shp->norm);
+
+	this->scale_texcoords(shp);
 
 	// add shp in scene
 	ygl::shape_group *sg = new ygl::shape_group;
@@ -932,7 +941,127 @@ void PBRTParser::execute_Shape() {
 		inst->frame = ygl::mat_to_frame(this->gState.CTM);
 		inst->name = get_unique_id(CounterID::instance);
 		scn->instances.push_back(inst);
+		// the shape is complete and used only here: stream it out and free it
+		if (sink) {
+			this->save_material_textures(shp->mat);
+			sink->add_shape(scn, sg, inst);
+			release_shape_data(shp);
+		}
+	}
+}
+
+//
+// scale_texcoords
+// handle texture coordinate scaling. v is also flipped, since texture images
+// are kept as in their files, with the top row first (instead of flipping
+// the images).
+//
+void PBRTParser::scale_texcoords(ygl::shape *shp) {
+	for (size_t i = 0; i < shp->texcoord.size(); i++) {
+		shp->texcoord[i].x *= gState.uscale;
+		shp->texcoord[i].y = 1 - shp->texcoord[i].y * gState.vscale;
+	}
+}
+
+//
+// parse_unit_shape
+// Parse the parameters of sphere, disk and cylinder shapes.
+// NOTE: zmin, zmax and phimax of spheres are not supported.
+//
+void PBRTParser::parse_unit_shape(std::string &shapeName, UnitShape &us) {
+	std::vector<std::shared_ptr<PBRTParameter>> params;
+	this->parse_parameters(params);
+
+	float radius = 1;
+	int i_rad = find_param("radius", params);
+	if (i_rad >= 0)
+		radius = params[i_rad]->get_first_value<float>();
+
+	us.type = shapeName;
+	if (shapeName == "sphere") {
+		us.key = "sphere";
+		us.frame = ygl::scaling_frame(ygl::vec3f{ radius, radius, radius });
+		return;
+	}
+
+	int i_phi = find_param("phimax", params);
+	if (i_phi >= 0)
+		us.phimax = ygl::clamp(params[i_phi]->get_first_value<float>(), 0.0f, 360.0f) * ygl::pif / 180;
+
+	char buff[100];
+	if (shapeName == "disk") {
+		float height = 0;
+		int i_h = find_param("height", params);
+		if (i_h >= 0)
+			height = params[i_h]->get_first_value<float>();
+		int i_in = find_param("innerradius", params);
+		if (i_in >= 0 && radius > 0)
+			us.inner = ygl::clamp(params[i_in]->get_first_value<float>() / radius, 0.0f, 1.0f);
+		us.frame = ygl::translation_frame(ygl::vec3f{ 0, 0, height }) *
+			ygl::scaling_frame(ygl::vec3f{ radius, radius, 1 });
+		sprintf(buff, "disk_%g_%g", us.inner, us.phimax);
+	}
+	else {
+		float zmin = -1, zmax = 1;
+		int i_zmin = find_param("zmin", params);
+		if (i_zmin >= 0)
+			zmin = params[i_zmin]->get_first_value<float>();
+		int i_zmax = find_param("zmax", params);
+		if (i_zmax >= 0)
+			zmax = params[i_zmax]->get_first_value<float>();
+		us.frame = ygl::translation_frame(ygl::vec3f{ 0, 0, zmin }) *
+			ygl::scaling_frame(ygl::vec3f{ radius, radius, zmax - zmin });
+		sprintf(buff, "cylinder_%g", us.phimax);
+	}
+	us.key = std::string(buff);
+}
+
+//
+// make_unit_shape
+// tessellate the unit shape described by us.
+//
+void PBRTParser::make_unit_shape(ygl::shape *shp, UnitShape &us) {
+	if (us.type == "sphere")
+		make_unit_sphere(shp);
+	else if (us.type == "disk")
+		make_unit_disk(shp, us.inner, us.phimax);
+	else
+		make_unit_cylinder(shp, us.phimax);
+}
+
+//
+// instance_unit_shape
+// Add an instance of a unit shape to the scene. The unit shape is tessellated
+// only the first time it is met with a given material and texture scaling,
+// then its shape group is shared by all the instances. "shp" already holds the
+// material and is consumed (either added to the scene or deleted).
+//
+void PBRTParser::instance_unit_shape(ygl::shape *shp, UnitShape &us) {
+	char buff[300];
+	sprintf(buff, "%s_%p_%g_%g", us.key.c_str(), (void *)shp->mat, gState.uscale, gState.vscale);
+	std::string key(buff);
+
+	ygl::shape_group *sg;
+	auto it = unitShapeGroups.find(key);
+	if (it != unitShapeGroups.end()) {
+		sg = it->second;
+		delete shp;
+	}
+	else {
+		this->make_unit_shape(shp, us);
+		this->scale_texcoords(shp);
+		sg = new ygl::shape_group;
+		sg->shapes.push_back(shp);
+		sg->name = get_unique_id(CounterID::shape_group);
+		scn->shapes.push_back(sg);
+		unitShapeGroups.insert(std::make_pair(key, sg));
 	}
+
+	ygl::instance *inst = new ygl::instance();
+	inst->shp = sg;
+	inst->frame = ygl::mat_to_frame(this->gState.CTM * ygl::frame_to_mat(us.frame));
+	inst->name = get_unique_id(CounterID::instance);
+	scn->instances.push_back(inst);
 }
 
 // ------------------- END SHAPES --------------------------------------------------
@@ -1074,7 +1203,7 @@ void PBRTParser::parse_InfiniteLight() {
 	if (mapname.length() > 0) {
 		ygl::texture *txt = new ygl::texture;
 		txt->name = get_unique_id(CounterID::texture);
-		load_texture(txt, mapname, false);
+		load_texture(txt, mapname);
 		scn->textures.push_back(txt);
 		env->ke_txt_info = new ygl::texture_info();
 		env->ke_txt = txt;
@@ -1118,11 +1247,10 @@ void PBRTParser::parse_PointLight() {
 
 	sg->shapes.push_back(lgtShape);
 
-	ygl::material *lgtMat = new ygl::material;
-	lgtMat->ke = I * scale;
-	lgtShape->mat = lgtMat;
-	lgtMat->name = get_unique_id(CounterID::material);
-	scn->materials.push_back(lgtMat);
+	std::shared_ptr<DeclaredMaterial> lgtMat(new DeclaredMaterial(new ygl::material));
+	lgtMat->mat->ke = I * scale;
+	lgtMat = canonical_material(lgtMat);
+	lgtShape->mat = add_material_to_scene(lgtMat);
 
 	scn->shapes.push_back(sg);
 	ygl::instance *inst = new ygl::instance;
@@ -1184,7 +1312,6 @@ void PBRTParser::execute_Material(bool namedMaterial) {
 
 	std::shared_ptr<DeclaredMaterial> dmat(new DeclaredMaterial);
 	dmat->mat = new ygl::material;
-	dmat->mat->name = get_unique_id(CounterID::material);
 
 	if (namedMaterial) {
 		if (this->current_token().type != LexemeType::STRING)
@@ -1245,12 +1372,44 @@ void PBRTParser::execute_Material(bool namedMaterial) {
 		warning_message("Material '" + materialType + "' not supported. Ignoring and using 'matte'..");
 		this->parse_material_matte(dmat, params);
 	}
+	dmat = canonical_material(dmat);
 	if (namedMaterial)
 		gState.nameToMaterial.insert(std::make_pair(materialName, dmat));
 	else
 		this->gState.mat = dmat;
 }
 
+//
+// canonical_material
+// Returns the declared material with the same parameters of dmat, if met before.
+// Otherwise dmat becomes the canonical one, and gets a name.
+// Exporters often repeat the same Material directive before every shape: this
+// way all of them share a single material.
+//
+std::shared_ptr<DeclaredMaterial> PBRTParser::canonical_material(std::shared_ptr<DeclaredMaterial> &dmat) {
+	auto h = hash_material(dmat->mat);
+	auto range = materialPool.equal_range(h);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (same_material(it->second->mat, dmat->mat))
+			return it->second;
+	}
+	dmat->mat->name = get_unique_id(CounterID::material);
+	materialPool.insert(std::make_pair(h, dmat));
+	return dmat;
+}
+
+//
+// add_material_to_scene
+// Add a declared material to the scene, the first time it is used.
+//
+ygl::material *PBRTParser::add_material_to_scene(std::shared_ptr<DeclaredMaterial> &dmat) {
+	if (!dmat->addedInScene) {
+		dmat->addedInScene = true;
+		scn->materials.push_back(dmat->mat);
+	}
+	return dmat->mat;
+}
+
 //
 // execute_NamedMaterial
 //
@@ -1472,53 +1631,26 @@ void PBRTParser::parse_material_glass(std::shared_ptr<DeclaredMaterial> &dmat, s
 // linearly blend two textures.
 //
 ygl::texture* PBRTParser::blend_textures(ygl::texture *txt1, ygl::texture *txt2, float amount) {
-
-	auto ts1 = TextureSupport(txt1);
-	auto ts2 = TextureSupport(txt2);
-	ygl::texture *txt = nullptr;
-
-	auto scale_single_texture = [&amount](TextureSupport &txtin)->ygl::texture* {
-		ygl::texture *txt = new ygl::texture();
-		txt->ldr = ygl::image4b(txtin.width, txtin.height);
-		for (int w = 0; w < txtin.width; w++) {
-			for (int h = 0; h < txtin.height; h++) {
-				txt->ldr.at(w, h) = ygl::float_to_byte(txtin.at(w, h)*(1 - amount));
-			}
-		}
-		return txt;
-	};
-
 	if (!txt1 && !txt2)
 		return nullptr;
-	else if (!txt1) {
-		txt = scale_single_texture(ts2);
-	}
-	else if (!txt2) {
-		txt = scale_single_texture(ts1);
+
+	auto node = TextureNode();
+	if (!txt1 || !txt2) {
+		// a single texture is scaled by 1 - amount
+		node.op = TextureOp::scale;
+		node.inputs[0] = txt1 ? txt1 : txt2;
+		node.values[1] = ygl::vec4f(1 - amount);
 	}
 	else {
-		txt = new ygl::texture();
-
-		int width = ts1.width > ts2.width ? ts1.width : ts2.width;
-		int height = ts1.height > ts2.height ? ts1.height : ts2.height;
-
-		auto img = ygl::image4b(width, height);
-
-		for (int w = 0; w < width; w++) {
-			for (int h = 0; h < height; h++) {
-				int w1 = w % ts1.width;
-				int h1 = h % ts1.height;
-				int w2 = w % ts2.width;
-				int h2 = h % ts2.height;
-
-				auto newPixel = ts1.at(w1, h1)* amount + ts2.at(w2, h2)* (1 - amount);
-				img.at(w, h) = ygl::float_to_byte(newPixel);
-			}
-		}
-		txt->ldr = img;
+		node.op = TextureOp::mix;
+		node.inputs[0] = txt1;
+		node.inputs[1] = txt2;
+		node.amount = amount;
 	}
+	ygl::texture *txt = new ygl::texture();
 	txt->name = get_unique_id(CounterID::texture);
 	txt->path = textureSavePath + "/" + txt->name + ".png";
+	textureGraph.set(txt, node);
 	scn->textures.push_back(txt);
 	return txt;
 }
@@ -1593,21 +1725,98 @@ void PBRTParser::set_k_property(std::shared_ptr<PBRTParameter> &par, ygl::vec3f
 // -----------------------------------------------------------------------------
 
 //
-// load_texture image from file
+// material_textures
+// textures used by a material (null if missing).
+//
+static std::vector<ygl::texture*> material_textures(const ygl::material *m) {
+	return { m->ke_txt, m->kd_txt, m->ks_txt, m->kr_txt, m->kt_txt,
+		m->rs_txt, m->bump_txt, m->disp_txt, m->norm_txt, m->occ_txt };
+}
+
+//
+// save_material_textures
+// When streaming, the textures of a material are computed and saved by the
+// sink the first time a streamed shape uses it, then their pixels are freed.
+//
+void PBRTParser::save_material_textures(const ygl::material *mat) {
+	if (!mat)
+		return;
+	std::vector<ygl::texture*> textures{};
+	for (auto txt : material_textures(mat))
+		if (txt && savedTextures.insert(txt).second)
+			textures.push_back(txt);
+	textureGraph.evaluate(textures, &textureSources, &textureImages);
+	for (auto txt : textures) {
+		if (sink->save_texture(txt)) {
+			txt->ldr = ygl::image4b();
+			txt->hdr = ygl::image4f();
+			textureImages.erase(txt);
+		}
+	}
+}
+
+//
+// finalize_textures
+// Computes the pixels of the derived textures used by the materials and the
+// environments of the scene (but the ones already saved), then deletes the
+// textures that are not used (in the scene or not).
+//
+void PBRTParser::finalize_textures() {
+	std::unordered_set<ygl::texture*> used{};
+	for (auto mat : scn->materials)
+		for (auto txt : material_textures(mat))
+			if (txt) used.insert(txt);
+	for (auto env : scn->environments)
+		if (env->ke_txt) used.insert(env->ke_txt);
+
+	std::vector<ygl::texture*> pending{};
+	for (auto txt : scn->textures)
+		if (used.count(txt) && !savedTextures.count(txt))
+			pending.push_back(txt);
+	textureGraph.evaluate(pending, &textureSources, &textureImages);
+
+	std::vector<ygl::texture*> kept{};
+	for (auto txt : scn->textures) {
+		if (used.count(txt))
+			kept.push_back(txt);
+		else
+			pendingTextures.insert(txt);
+	}
+	scn->textures = kept;
+	for (auto txt : pendingTextures) {
+		textureGraph.remove(txt);
+		textureSources.erase(txt);
+		textureImages.erase(txt);
+		delete txt;
+	}
+	pendingTextures.clear();
+	proceduralTextures.clear();
+}
+
 //
-void PBRTParser::load_texture(ygl::texture *txt, std::string &filename, bool flip) {
+// load_texture
+// Images are not decoded: their files are copied when saving the scene, and
+// read only if a combinator needs their pixels. Textures are used as stored in
+// the files (top row first), the v texture coordinate is flipped instead
+// (see scale_texcoords).
+//
+void PBRTParser::load_texture(ygl::texture *txt, std::string &filename) {
 	auto completePath = this->current_path() + "/" + filename;
 	auto ext = ygl::path_extension(filename);
 	auto name = ygl::path_basename(filename);
-	ext = ext == ".exr" ? ".hdr" : ext;
 	txt->path = textureSavePath + "/" + name + ext;
-	if (ext == ".hdr") {
-		auto im = ygl::load_image4f(completePath);
-		txt->hdr = flip ? flip_image(im) : im;
-	}
-	else {
-		auto im = ygl::load_image4b(completePath);
-		txt->ldr = flip ? flip_image(im) : im;
+	// missing images are left empty (and not saved)
+	auto f = fopen(completePath.c_str(), "rb");
+	if (f) {
+		fclose(f);
+		// too big images are kept in memory downscaled (with the channels they
+		// use), and saved again
+		if (maxTextureSize > 0 && load_downscaled_texture(txt, completePath, maxTextureSize)) {
+			txt->path = textureSavePath + "/" + name + (!txt->ldr.empty() ? ".png" : ext == ".exr" ? ".exr" : ".hdr");
+			reduce_texture(txt, textureImages);
+			return;
+		}
+		textureSources[txt] = completePath;
 	}
 }
 
@@ -1664,7 +1873,10 @@ void PBRTParser::parse_constant_texture(std::shared_ptr<DeclaredTexture> &dt) {
 			value = params[i_v]->get_first_value<ygl::vec3f>();
 		}
 	}
-	dt->txt->ldr = make_constant_image(value);
+	auto node = TextureNode();
+	node.op = TextureOp::constant;
+	node.values[0] = { value.x, value.y, value.z, 1 };
+	textureGraph.set(dt->txt, node);
 }
 
 //
@@ -1721,7 +1933,42 @@ void PBRTParser::parse_checkerboard_texture(std::shared_ptr<DeclaredTexture> &dt
 	if (dt->uscale < 0) dt->uscale = 1;
 	if (dt->vscale < 0) dt->vscale = 1;
 
-	dt->txt->ldr = ygl::make_checker_image(128, 128, 64, float_to_byte(tex1), float_to_byte(tex2));
+	// a period (two checks) is baked for every unit of the scaled texture
+	// coordinates: at proceduralResolution pixels per unit of the original ones
+	auto period_size = [this](float scale) {
+		auto size = this->proceduralResolution / std::max(scale, 1e-6f);
+		int pixels = 4;
+		while (pixels < 2048 && pixels * 1.5f < size)
+			pixels *= 2;
+		return pixels;
+	};
+	auto node = TextureNode();
+	node.op = TextureOp::checkerboard;
+	node.values[0] = tex1;
+	node.values[1] = tex2;
+	node.width = period_size(dt->uscale);
+	node.height = period_size(dt->vscale);
+	this->share_procedural_texture(dt, node);
+}
+
+//
+// share_procedural_texture
+// Sets the node of a procedural texture, or replaces the texture with an
+// identical one declared before.
+//
+void PBRTParser::share_procedural_texture(std::shared_ptr<DeclaredTexture> &dt, const TextureNode &node) {
+	auto h = hash_texture_node(node);
+	auto range = proceduralTextures.equal_range(h);
+	for (auto it = range.first; it != range.second; it++) {
+		if (!same_texture_node(node, textureGraph.node(it->second)))
+			continue;
+		pendingTextures.erase(dt->txt);
+		delete dt->txt;
+		dt->txt = it->second;
+		return;
+	}
+	textureGraph.set(dt->txt, node);
+	proceduralTextures.insert(std::make_pair(h, dt->txt));
 }
 
 //
@@ -1729,85 +1976,35 @@ void PBRTParser::parse_checkerboard_texture(std::shared_ptr<DeclaredTexture> &dt
 //
 void PBRTParser::parse_scale_texture(std::shared_ptr<DeclaredTexture> &dt) {
 
-	bool free_ytex1 = false;
-	bool free_ytex2 = false;
-	ygl::texture *ytex1;
-	ygl::texture *ytex2;
-
 	// read parameters
 	std::vector<std::shared_ptr<PBRTParameter>> params{};
 	this->parse_parameters(params);
-	
-	// first get the first texture
-	int i_tex1 = find_param("tex1", params);
-	if (i_tex1 == -1)
-		throw_syntax_exception("Impossible to create scale texture, missing tex1.");
 
-	if (params[i_tex1]->type == "texture") {
-		ytex1 = texture_lookup(params[i_tex1]->get_first_value<std::string>(), false)->txt;
-	}
-	else {
-		free_ytex1 = true;
-		ytex1 = new ygl::texture();
-		if (params[i_tex1]->type == "float")
-			ytex1->ldr = make_constant_image(params[i_tex1]->get_first_value<float>());
-		else if (params[i_tex1]->type == "rgb")
-			ytex1->ldr = make_constant_image(params[i_tex1]->get_first_value<ygl::vec3f>());
-		else
-			throw_syntax_exception("Texture argument 'tex1' type not recognised in scale texture.");
-	}
-	// retrieve the textures
-	int i_tex2 = find_param("tex2", params);
-	if (i_tex2 == -1) {
-		if (free_ytex1)
-			delete ytex1;
-		throw_syntax_exception("Impossible to create scale texture, missing tex2.");
-	}
-		
-	if (params[i_tex2]->type == "texture") {
-		ytex2 = texture_lookup(params[i_tex2]->get_first_value<std::string>(), false)->txt;
-	}
-	else {
-		ytex2 = new ygl::texture();
-		free_ytex2 = true;
-		if (params[i_tex2]->type == "float")
-			ytex2->ldr = make_constant_image(params[i_tex2]->get_first_value<float>());
-		else if (params[i_tex2]->type == "rgb")
-			ytex2->ldr = make_constant_image(params[i_tex2]->get_first_value<ygl::vec3f>());
-		else {
-			if (free_ytex1)
-				delete ytex1;
-			if (free_ytex2)
-				delete ytex2;
-			throw_syntax_exception("Texture argument 'tex2' type not recognised in scale texture.");
+	auto node = TextureNode();
+	node.op = TextureOp::scale;
+	// operands are textures or constants (stored in 8 bits, as images)
+	auto set_operand = [&](int i, const std::string &name) {
+		int i_tex = find_param(name, params);
+		if (i_tex == -1)
+			throw_syntax_exception("Impossible to create scale texture, missing " + name + ".");
+		auto &par = params[i_tex];
+		if (par->type == "texture") {
+			node.inputs[i] = texture_lookup(par->get_first_value<std::string>(), false)->txt;
 		}
-			
-	}
-	auto ts1 = TextureSupport(ytex1);
-	auto ts2 = TextureSupport(ytex2);
-	// NOTE: tiling of the smaller texture is performed here. Check if pbrt does the same
-
-	int width = ts1.width > ts2.width ? ts1.width : ts2.width;
-	int height = ts1.height > ts2.height ? ts1.height : ts2.height;
-	auto img = ygl::image4b(width, height);
-
-	for (int w = 0; w < width; w++) {
-		for (int h = 0; h < height; h++) {
-			int w1 = w % ts1.width;
-			int h1 = h % ts1.height;
-			int w2 = w % ts2.width;
-			int h2 = h % ts2.height;
-
-			auto newPixel = ts1.at(w1, h1)* ts2.at(w2, h2);
-			img.at(w, h) = ygl::float_to_byte(newPixel);
+		else if (par->type == "float") {
+			node.values[i] = ygl::byte_to_float(make_constant_image(par->get_first_value<float>()).at(0, 0));
 		}
-	}
-	dt->txt->ldr = img;
-
-	if (free_ytex1)
-		delete ytex1;
-	if (free_ytex2)
-		delete ytex2;
+		else if (par->type == "rgb") {
+			node.values[i] = ygl::byte_to_float(make_constant_image(par->get_first_value<ygl::vec3f>()).at(0, 0));
+		}
+		else {
+			throw_syntax_exception("Texture argument '" + name + "' type not recognised in scale texture.");
+		}
+	};
+	set_operand(0, "tex1");
+	set_operand(1, "tex2");
+	// NOTE: tiling of the smaller texture is performed when evaluating. Check if pbrt does the same
+	textureGraph.set(dt->txt, node);
 
 	int i_u = find_param("uscale", params);
 	if (i_u >= 0)
@@ -1830,6 +2027,7 @@ void PBRTParser::execute_Texture() {
 	txt->name = get_unique_id(CounterID::texture);
 	txt->path = textureSavePath + "/" + txt->name + ".png";
 	dt->txt = txt;
+	pendingTextures.insert(txt);
 
 	if (this->current_token().type != LexemeType::STRING)
 		throw_syntax_exception("Expected texture name string.");
@@ -1876,6 +2074,67 @@ void PBRTParser::execute_Texture() {
 //                                    AUXILIARY FUNCTIONS
 // ==========================================================================================
 
+//
+// hash_material
+// hash of all the parameters of a material (texture pointers included), but its name.
+//
+uint64_t hash_material(const ygl::material *m) {
+	uint64_t h = hash_bytes(&m->double_sided, sizeof(m->double_sided));
+	h = hash_bytes(&m->type, sizeof(m->type), h);
+	for (auto k : { &m->ke, &m->kd, &m->ks, &m->kr, &m->kt })
+		h = hash_bytes(k, sizeof(ygl::vec3f), h);
+	h = hash_bytes(&m->rs, sizeof(m->rs), h);
+	h = hash_bytes(&m->op, sizeof(m->op), h);
+	for (auto t : { m->ke_txt, m->kd_txt, m->ks_txt, m->kr_txt, m->kt_txt,
+		m->rs_txt, m->bump_txt, m->disp_txt, m->norm_txt, m->occ_txt })
+		h = hash_bytes(&t, sizeof(t), h);
+	return h;
+}
+
+//
+// same_material
+// true if the two materials have the same parameters (see hash_material).
+// Values are compared bitwise, as the hash does.
+//
+bool same_material(const ygl::material *a, const ygl::material *b) {
+	auto same_info = [](const ygl::texture_info *x, const ygl::texture_info *y) {
+		if (!x || !y)
+			return x == y;
+		return x->wrap_s == y->wrap_s && x->wrap_t == y->wrap_t && x->linear == y->linear &&
+			x->mipmap == y->mipmap && x->scale == y->scale;
+	};
+	auto same_bits = [](const void *x, const void *y, size_t size) {
+		return memcmp(x, y, size) == 0;
+	};
+	return a->double_sided == b->double_sided && a->type == b->type &&
+		same_bits(&a->ke, &b->ke, sizeof(ygl::vec3f)) && same_bits(&a->kd, &b->kd, sizeof(ygl::vec3f)) &&
+		same_bits(&a->ks, &b->ks, sizeof(ygl::vec3f)) && same_bits(&a->kr, &b->kr, sizeof(ygl::vec3f)) &&
+		same_bits(&a->kt, &b->kt, sizeof(ygl::vec3f)) && same_bits(&a->rs, &b->rs, sizeof(float)) &&
+		same_bits(&a->op, &b->op, sizeof(float)) &&
+		a->ke_txt == b->ke_txt && a->kd_txt == b->kd_txt && a->ks_txt == b->ks_txt &&
+		a->kr_txt == b->kr_txt && a->kt_txt == b->kt_txt && a->rs_txt == b->rs_txt &&
+		a->bump_txt == b->bump_txt && a->disp_txt == b->disp_txt &&
+		a->norm_txt == b->norm_txt && a->occ_txt == b->occ_txt &&
+		same_info(a->ke_txt_info, b->ke_txt_info) && same_info(a->kd_txt_info, b->kd_txt_info) &&
+		same_info(a->ks_txt_info, b->ks_txt_info) && same_info(a->kr_txt_info, b->kr_txt_info) &&
+		same_info(a->kt_txt_info, b->kt_txt_info) && same_info(a->rs_txt_info, b->rs_txt_info) &&
+		same_info(a->bump_txt_info, b->bump_txt_info) && same_info(a->disp_txt_info, b->disp_txt_info) &&
+		same_info(a->norm_txt_info, b->norm_txt_info) && same_info(a->occ_txt_info, b->occ_txt_info);
+}
+
+//
+// copy_material
+// The texture_info of the copy are copies too, as materials delete their own.
+//
+ygl::material *copy_material(const ygl::material *m) {
+	auto copy = new ygl::material(*m);
+	for (auto info : { &copy->ke_txt_info, &copy->kd_txt_info, &copy->ks_txt_info,
+		&copy->kr_txt_info, &copy->kt_txt_info, &copy->rs_txt_info, &copy->bump_txt_info,
+		&copy->disp_txt_info, &copy->norm_txt_info, &copy->occ_txt_info })
+		if (*info) *info = new ygl::texture_info(**info);
+	return copy;
+}
+
 //
 // make_constant_image
 //
@@ -1910,20 +2169,3 @@ int find_param(std::string name, std::vector<std::shared_ptr<PBRTParameter>> &ve
 	}
 	return -1;
 }
-
-//
-// my_compute_normals
-// because pbrt computes it differently
-// TODO: must be removed in future.
-//
-void my_compute_normals(const std::vector<ygl::vec3i>& triangles,
-	const std::vector<ygl::vec3f>& pos, std::vector<ygl::vec3f>& norm, bool weighted) {
-	norm.resize(pos.size());
-	for (auto& n : norm) n = ygl::zero3f;
-	for (auto& t : triangles) {
-		auto n = cross(pos[t.y] - pos[t.z], pos[t.x] - pos[t.z]); // it is different here
-		if (!weighted) n = normalize(n);
-		for (auto vid : t) norm[vid] += n;
-	}
-	for (auto& n : norm) n = normalize(n);
-}
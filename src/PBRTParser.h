@@ -18,6 +18,7 @@
 #include <sstream>
 #include <exception>
 #include <unordered_map>
+#include <unordered_set>
 #define YGL_IMAGEIO 1
 #define YGL_OPENGL 0
 #include "../yocto/yocto_gl.h"
@@ -25,6 +26,10 @@
 #include "PLYParser.h"
 #include "utils.h"
 #include "spectrum.h"
+#include "geometry.h"
+#include "ShapeSink.h"
+#include "TextureWriter.h"
+#include "TextureGraph.h"
 
 // A general directive parsed parameter has type, name and value.
 class PBRTParameter {
@@ -72,6 +77,9 @@ class PBRTParameter {
 // Among other things, we introduce these support structures to avoid saving resources
 // that are not used (even if declared).
 
+// The texture is owned by the parser (see pendingTextures) until it is added
+// to the scene: it can be used by other textures, or shared by more
+// declarations (procedural textures), after the declaration is gone.
 struct DeclaredTexture {
 	ygl::texture *txt = nullptr;
 	float uscale = 1;
@@ -80,11 +88,6 @@ struct DeclaredTexture {
 
 	DeclaredTexture() {};
 	DeclaredTexture(ygl::texture *t, float uscale, float vscale) : txt(t), uscale(uscale), vscale(vscale) {};
-	
-	~DeclaredTexture() {
-		if (!addedInScene && txt)
-			delete txt;
-	};
 };
 
 struct DeclaredMaterial {
@@ -115,6 +118,17 @@ struct DeclaredObject {
 };
 
 
+// Analytic shapes (sphere, disk, cylinder) are tessellated once as unit shapes
+// and instanced with a frame that brings them to the requested size.
+// "key" identifies the unit tessellation, the other fields are used to build it.
+struct UnitShape {
+	std::string key;
+	std::string type;
+	float inner = 0;
+	float phimax = 2 * ygl::pif;
+	ygl::frame3f frame = ygl::identity_frame3f;
+};
+
 struct GraphicsState {
 	// Current Transformation Matrix
 	ygl::mat4f CTM;
@@ -138,39 +152,6 @@ struct GraphicsState {
 };
 
 
-// This structure will simplify the code later, allowing to work at the same time with
-// both HDR and LDR images.
-class TextureSupport {
-public:
-	ygl::texture *txt;
-	int height;
-	int width;
-	bool is_hdr;
-
-	ygl::vec4f at(int i, int j) {
-		if(is_hdr)
-			return txt->hdr.at(i, j);
-		else
-			return ygl::byte_to_float(txt->ldr.at(i, j));
-	};
-
-	TextureSupport(ygl::texture *t) {
-		txt = t;
-		if (!t)
-			return;
-		if (t->ldr.empty()) {
-			is_hdr = true;
-			height = t->hdr.height();
-			width = t->hdr.width();
-		}
-		else {
-			is_hdr = false;
-			height = t->ldr.height();
-			width = t->ldr.width();
-		}	
-	};
-};
-
 class PBRTParser {
 
     private:
@@ -210,6 +191,14 @@ class PBRTParser {
 	// name to pair (list_of_shapes, CTM)
 	std::unordered_map < std::string, std::shared_ptr<DeclaredObject>> nameToObject{}; // instancing
 
+	// Materials met so far, by hash of their parameters. Every declared material
+	// is replaced by the equal one found here, if any. See canonical_material().
+	std::unordered_multimap<uint64_t, std::shared_ptr<DeclaredMaterial>> materialPool{};
+
+	// shape groups holding unit analytic shapes, by unit shape key, material
+	// and texture coordinate scaling. See instance_unit_shape().
+	std::unordered_map<std::string, ygl::shape_group *> unitShapeGroups{};
+
 	// the following items are used to assign unique names to elements.
 	unsigned int shapeCounter = 0;
 	unsigned int shapeGroupCounter = 0;
@@ -265,6 +254,10 @@ class PBRTParser {
 
 	void execute_Shape();
 	void parse_trianglemesh(ygl::shape *shp);
+	void parse_unit_shape(std::string &shapeName, UnitShape &us);
+	void make_unit_shape(ygl::shape *shp, UnitShape &us);
+	void instance_unit_shape(ygl::shape *shp, UnitShape &us);
+	void scale_texcoords(ygl::shape *shp);
 	// DEBUG method
 	void parse_cube(ygl::shape *shp);
 
@@ -278,6 +271,9 @@ class PBRTParser {
 	void execute_Material(bool makeNamedMaterial);
 	void execute_NamedMaterial();
 
+	std::shared_ptr<DeclaredMaterial> canonical_material(std::shared_ptr<DeclaredMaterial> &dmat);
+	ygl::material *add_material_to_scene(std::shared_ptr<DeclaredMaterial> &dmat);
+
 	void parse_material_matte(std::shared_ptr<DeclaredMaterial> &dmat, std::vector<std::shared_ptr<PBRTParameter>> &params);
 	void parse_material_uber(std::shared_ptr<DeclaredMaterial> &dmat, std::vector<std::shared_ptr<PBRTParameter>> &params);
 	void parse_material_plastic(std::shared_ptr<DeclaredMaterial> &dmat, std::vector<std::shared_ptr<PBRTParameter>> &params);
@@ -288,8 +284,11 @@ class PBRTParser {
 	void parse_material_glass(std::shared_ptr<DeclaredMaterial> &dmat, std::vector<std::shared_ptr<PBRTParameter>> &params);
 	void parse_material_substrate(std::shared_ptr<DeclaredMaterial> &dmat, std::vector<std::shared_ptr<PBRTParameter>> &params);
 	
-	void load_texture(ygl::texture *txt, std::string &filename, bool flip = true);
+	void load_texture(ygl::texture *txt, std::string &filename);
 	ygl::texture* blend_textures(ygl::texture *txt1, ygl::texture *txt2, float amount);
+	void save_material_textures(const ygl::material *mat);
+	void finalize_textures();
+	void share_procedural_texture(std::shared_ptr<DeclaredTexture> &dt, const TextureNode &node);
 	void parse_imagemap_texture(std::shared_ptr<DeclaredTexture> &dt);
 	void parse_constant_texture(std::shared_ptr<DeclaredTexture> &dt);
 	void parse_scale_texture(std::shared_ptr<DeclaredTexture> &dt);
@@ -333,7 +332,7 @@ class PBRTParser {
 	std::shared_ptr<PBRTParameter>  parse_parameter();
 	
 	// parse all the parameters of the current directive
-	void PBRTParser::parse_parameters(std::vector<std::shared_ptr<PBRTParameter>> &pars);
+	void parse_parameters(std::vector<std::shared_ptr<PBRTParameter>> &pars);
 
 	//
 	// parse_value
@@ -373,12 +372,14 @@ class PBRTParser {
 	//
 	// texture lookup.
 	//
-	std::shared_ptr<DeclaredTexture> texture_lookup(std::string &name, bool markAsAddedInScene) {
+	std::shared_ptr<DeclaredTexture> texture_lookup(const std::string &name, bool markAsAddedInScene) {
 		auto it = gState.nameToTexture.find(name);
 		if (it == gState.nameToTexture.end())
 			throw_syntax_exception("Texture '" + name + "' was not found among declared textures.");
 		if (markAsAddedInScene && it->second->addedInScene == false) {
-			scn->textures.push_back(it->second->txt);
+			// (the texture can be shared with another declaration already added)
+			if (pendingTextures.erase(it->second->txt))
+				scn->textures.push_back(it->second->txt);
 			it->second->addedInScene = true;
 		}
 		return it->second;
@@ -387,7 +388,7 @@ class PBRTParser {
 	//
 	// material lookup.
 	//
-	std::shared_ptr<DeclaredMaterial> material_lookup(std::string &name, bool markAsAddedInScene) {
+	std::shared_ptr<DeclaredMaterial> material_lookup(const std::string &name, bool markAsAddedInScene) {
 		auto it = gState.nameToMaterial.find(name);
 		if (it == gState.nameToMaterial.end())
 			throw_syntax_exception("Named material '" + name + "' was not found among declared named materials.");
@@ -398,9 +399,46 @@ class PBRTParser {
 		return it->second;
 	}
 
+	// where non instanced shapes are sent as soon as they are parsed (if any)
+	ShapeSink *sink = nullptr;
+	// textures saved by the sink
+	std::unordered_set<ygl::texture*> savedTextures{};
+	// operations computing the derived textures
+	TextureGraph textureGraph{};
+	// declared textures not yet in the scene, deleted at the end if still unused
+	std::unordered_set<ygl::texture*> pendingTextures{};
+	// procedural textures by the hash of their node, to share the identical ones
+	std::unordered_multimap<uint64_t, ygl::texture*> proceduralTextures{};
+	// pixels of the procedural textures per unit of texture coordinates
+	int proceduralResolution = 128;
+	// image files of the imagemap textures
+	TextureSources textureSources{};
+	// pixels of the computed and downscaled textures, with the channels they use
+	TextureImages textureImages{};
+	// meshes are welded with this tolerance, if not negative
+	float weldTolerance = -1;
+	// bigger textures are downscaled, if positive
+	int maxTextureSize = 0;
+	// identical shape groups are merged at the end of the parsing
+	bool mergeDuplicates = true;
+
 	public:
 	// Build a parser for the scene pointed by "filename"
 	PBRTParser(std::string filename);
+	// stream the shapes to sink while parsing (it is not owned by the parser)
+	void set_shape_sink(ShapeSink *sink) { this->sink = sink; }
+	// weld the vertices of the parsed meshes (see weld_vertices), negative to disable
+	void set_weld_tolerance(float tolerance) { weldTolerance = tolerance; }
+	// downscale the image textures bigger than size (see downscale_image), 0 to disable
+	void set_max_texture_size(int size) { maxTextureSize = size; }
+	// merge the identical shape groups (see merge_duplicate_shapes) at the end of parse
+	void set_merge_duplicates(bool merge) { mergeDuplicates = merge; }
+	// source files of the textures to copy when saving the scene
+	const TextureSources &texture_sources() const { return textureSources; }
+	TextureSources &texture_sources() { return textureSources; }
+	// pixels of the textures kept in memory, instead of the ones of the textures
+	const TextureImages &texture_images() const { return textureImages; }
+	TextureImages &texture_images() { return textureImages; }
 	// start the parsing.
     ygl::scene *parse();
 
@@ -417,6 +455,25 @@ class PBRTParser {
 //
 int find_param(std::string name, std::vector<std::shared_ptr<PBRTParameter>> &vec);
 
+//
+// hash_material
+// hash of all the parameters of a material (texture pointers included), but its name.
+//
+uint64_t hash_material(const ygl::material *m);
+
+//
+// same_material
+// true if the two materials have the same parameters (see hash_material).
+//
+bool same_material(const ygl::material *a, const ygl::material *b);
+
+//
+// copy_material
+// new material with the parameters of m (textures are shared, not their
+// texture_info).
+//
+ygl::material *copy_material(const ygl::material *m);
+
 //
 // make_constant_image
 //
@@ -438,12 +495,4 @@ ygl::image<T> flip_image(ygl::image<T> in) {
 	}
 	return nI;
 }
-
-//
-// my_compute_normals
-// because pbrt computes it differently
-// TODO: must be removed in future.
-//
-void my_compute_normals(const std::vector<ygl::vec3i>& triangles,
-	const std::vector<ygl::vec3f>& pos, std::vector<ygl::vec3f>& norm, bool weighted);
 #endif
@@ -0,0 +1,36 @@
+#ifndef __SHAPESINK__
+#define __SHAPESINK__
+#include "../yocto/yocto_gl.h"
+
+//
+// ShapeSink
+// Receives the shapes of a scene while it is being parsed (streaming conversion).
+// add_shape is called for every shape group that is used by a single instance,
+// as soon as it is complete: after the call the parser releases its vertex data,
+// keeping only the (empty) shapes in the scene. save_texture is called for the
+// textures of the material of a streamed shape, the first time: if it returns
+// true the texture has been saved and the parser releases its pixels. finish is
+// called with the whole scene, to save what has not been streamed (instanced
+// shapes, materials, cameras...).
+//
+class ShapeSink {
+	public:
+	virtual ~ShapeSink() {}
+	virtual void add_shape(const ygl::scene *scn, const ygl::shape_group *sg, const ygl::instance *inst) = 0;
+	virtual bool save_texture(const ygl::texture * /*txt*/) { return false; }
+	virtual void finish(const ygl::scene *scn) = 0;
+};
+
+//
+// release_shape_data
+// Frees the vertex and element arrays of a shape.
+//
+inline void release_shape_data(ygl::shape *shp) {
+	auto mat = shp->mat;
+	auto name = shp->name;
+	*shp = ygl::shape();
+	shp->mat = mat;
+	shp->name = name;
+}
+
+#endif
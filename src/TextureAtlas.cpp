@@ -0,0 +1,228 @@
+#include "TextureAtlas.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstring>
+#include "../yocto/ext/stb_image.h"
+#define STB_RECT_PACK_IMPLEMENTATION
+#define STBRP_STATIC
+#include "../yocto/ext/imgui/stb_rect_pack.h"
+
+// texture slots of a material
+static std::vector<ygl::texture**> material_slots(ygl::material *m) {
+	return { &m->ke_txt, &m->kd_txt, &m->ks_txt, &m->kr_txt, &m->kt_txt,
+		&m->rs_txt, &m->bump_txt, &m->disp_txt, &m->norm_txt, &m->occ_txt };
+}
+
+// the only texture used by a material, null if it uses none or more than one
+static ygl::texture *single_texture(ygl::material *m) {
+	ygl::texture *single = nullptr;
+	for (auto slot : material_slots(m)) {
+		if (!*slot || *slot == single) continue;
+		if (single) return nullptr;
+		single = *slot;
+	}
+	return single;
+}
+
+// true if the shape has texture coordinates, all of them in [0, 1]
+static bool unit_texcoords(const ygl::shape *shp) {
+	if (shp->texcoord.empty())
+		return false;
+	for (auto &uv : shp->texcoord)
+		if (!(uv.x >= 0 && uv.x <= 1 && uv.y >= 0 && uv.y <= 1))
+			return false;
+	return true;
+}
+
+// size of the 8 bit image of a texture (from its pixels or its source file),
+// false for hdr and unreadable images
+static bool ldr_size(const ygl::texture *txt, const TextureSources *sources, const TextureImages *images,
+	int &width, int &height) {
+	auto img = texture_image(txt, images);
+	if (img) {
+		width = img->width;
+		height = img->height;
+		return !img->ldr.empty();
+	}
+	if (!txt->ldr.empty()) {
+		width = txt->ldr.width();
+		height = txt->ldr.height();
+		return true;
+	}
+	if (!txt->hdr.empty() || !sources)
+		return false;
+	auto it = sources->find(txt);
+	if (it == sources->end())
+		return false;
+	auto ext = ygl::path_extension(it->second);
+	int ncomp;
+	return ext != ".hdr" && ext != ".exr" &&
+		stbi_info(it->second.c_str(), &width, &height, &ncomp) && width > 0 && height > 0;
+}
+
+// Texture placed in an atlas: its pixels start at (x, y), after the padding.
+struct AtlasItem {
+	ygl::texture *txt;
+	int width, height;
+	int atlas = -1, x = 0, y = 0;
+};
+
+int pack_texture_atlases(ygl::scene *scn, const AtlasOptions &opts, TextureSources *sources,
+	TextureImages *images) {
+	auto atlasSize = std::min(opts.atlasSize, 0xffff);
+
+	// materials that can be remapped, with their texture
+	std::unordered_map<ygl::material*, ygl::texture*> materialTexture{};
+	for (auto mat : scn->materials) {
+		auto txt = single_texture(mat);
+		if (txt)
+			materialTexture[mat] = txt;
+	}
+	for (auto sg : scn->shapes)
+		for (auto shp : sg->shapes)
+			if (shp->mat && materialTexture.count(shp->mat) && !unit_texcoords(shp))
+				materialTexture.erase(shp->mat);
+
+	// textures used only by those materials
+	std::unordered_set<ygl::texture*> excluded{};
+	for (auto mat : scn->materials)
+		if (!materialTexture.count(mat))
+			for (auto slot : material_slots(mat))
+				if (*slot) excluded.insert(*slot);
+	for (auto env : scn->environments)
+		if (env->ke_txt) excluded.insert(env->ke_txt);
+
+	std::vector<AtlasItem> items{};
+	std::unordered_map<ygl::texture*, int> itemIndex{};
+	for (auto txt : scn->textures) {
+		auto item = AtlasItem{ txt, 0, 0 };
+		if (excluded.count(txt) || !ldr_size(txt, sources, images, item.width, item.height))
+			continue;
+		if (item.width > opts.maxSize || item.height > opts.maxSize ||
+			item.width + 2 * opts.padding > atlasSize || item.height + 2 * opts.padding > atlasSize)
+			continue;
+		itemIndex[txt] = (int)items.size();
+		items.push_back(item);
+	}
+	if (items.size() < 2)
+		return 0;
+
+	// pack in as many atlases as needed, cropped to the packed textures
+	std::vector<ygl::vec2i> atlasSizes{};
+	std::vector<stbrp_rect> rects{};
+	for (int i = 0; i < (int)items.size(); i++) {
+		auto rect = stbrp_rect();
+		rect.id = i;
+		rect.w = (stbrp_coord)(items[i].width + 2 * opts.padding);
+		rect.h = (stbrp_coord)(items[i].height + 2 * opts.padding);
+		rects.push_back(rect);
+	}
+	std::vector<stbrp_node> nodes(atlasSize);
+	while (!rects.empty()) {
+		stbrp_context context;
+		stbrp_init_target(&context, atlasSize, atlasSize, nodes.data(), (int)nodes.size());
+		stbrp_pack_rects(&context, rects.data(), (int)rects.size());
+		auto size = ygl::vec2i{ 0, 0 };
+		std::vector<stbrp_rect> remaining{};
+		for (auto &rect : rects) {
+			if (!rect.was_packed) {
+				remaining.push_back(rect);
+				continue;
+			}
+			auto &item = items[rect.id];
+			item.atlas = (int)atlasSizes.size();
+			item.x = rect.x + opts.padding;
+			item.y = rect.y + opts.padding;
+			size.x = std::max(size.x, rect.x + rect.w);
+			size.y = std::max(size.y, rect.y + rect.h);
+		}
+		if (remaining.size() == rects.size())
+			break;
+		atlasSizes.push_back(size);
+		rects = remaining;
+	}
+
+	// copy the images, extending their edges in the padding
+	std::vector<ygl::texture*> atlases{};
+	std::unordered_set<std::string> paths{};
+	for (auto txt : scn->textures)
+		paths.insert(txt->path);
+	auto dirname = ygl::path_dirname(items[0].txt->path);
+	for (auto &size : atlasSizes) {
+		auto atlas = new ygl::texture();
+		for (int n = 0; ; n++) {
+			atlas->name = "atlas_" + std::to_string(n);
+			atlas->path = dirname + atlas->name + ".png";
+			if (paths.insert(atlas->path).second) break;
+		}
+		atlas->ldr = ygl::image4b(size.x, size.y, { 0, 0, 0, 0 });
+		atlases.push_back(atlas);
+	}
+	parallel_tasks((int)items.size(), [&](int i) {
+		auto &item = items[i];
+		auto reduced = texture_image(item.txt, images);
+		auto img = (reduced) ? expand_image4b(*reduced) :
+			item.txt->ldr.empty() ? ygl::load_image4b(sources->at(item.txt)) : item.txt->ldr;
+		if (img.width() != item.width || img.height() != item.height)
+			img = ygl::image4b(item.width, item.height, { 0, 0, 0, 255 });
+		auto &atlas = atlases[item.atlas]->ldr;
+		auto pixels = ygl::data(atlas);
+		for (int y = -opts.padding; y < item.height + opts.padding; y++) {
+			auto src = ygl::data(img) + (size_t)ygl::clamp(y, 0, item.height - 1) * item.width;
+			auto dst = pixels + (size_t)(item.y + y) * atlas.width() + item.x;
+			for (int x = -opts.padding; x < 0; x++)
+				dst[x] = src[0];
+			std::memcpy(dst, src, item.width * sizeof(ygl::vec4b));
+			for (int x = item.width; x < item.width + opts.padding; x++)
+				dst[x] = src[item.width - 1];
+		}
+	});
+
+	// remap the texture coordinates and the materials
+	for (auto sg : scn->shapes) {
+		for (auto shp : sg->shapes) {
+			auto mt = materialTexture.find(shp->mat);
+			if (!shp->mat || mt == materialTexture.end() || !itemIndex.count(mt->second))
+				continue;
+			auto &item = items[itemIndex.at(mt->second)];
+			if (item.atlas < 0)
+				continue;
+			auto &atlas = atlases[item.atlas]->ldr;
+			auto scale = ygl::vec2f{ (float)item.width / atlas.width(), (float)item.height / atlas.height() };
+			auto offset = ygl::vec2f{ (float)item.x / atlas.width(), (float)item.y / atlas.height() };
+			auto &texcoord = shp->texcoord;
+			parallel_for((int)texcoord.size(), [&](int start, int end) {
+				for (int i = start; i < end; i++)
+					texcoord[i] = offset + texcoord[i] * scale;
+			});
+		}
+	}
+	for (auto &mt : materialTexture) {
+		auto it = itemIndex.find(mt.second);
+		if (it == itemIndex.end() || items[it->second].atlas < 0)
+			continue;
+		for (auto slot : material_slots(mt.first))
+			if (*slot) *slot = atlases[items[it->second].atlas];
+	}
+
+	// replace the packed textures with the atlases
+	int packed = 0;
+	std::vector<ygl::texture*> textures{};
+	for (auto txt : scn->textures) {
+		auto it = itemIndex.find(txt);
+		if (it == itemIndex.end() || items[it->second].atlas < 0) {
+			textures.push_back(txt);
+			continue;
+		}
+		if (sources)
+			sources->erase(txt);
+		if (images)
+			images->erase(txt);
+		delete txt;
+		packed++;
+	}
+	textures.insert(textures.end(), atlases.begin(), atlases.end());
+	scn->textures = textures;
+	return packed;
+}
@@ -0,0 +1,36 @@
+#ifndef __TEXTUREATLAS__
+#define __TEXTUREATLAS__
+#include <string>
+#include <vector>
+#include "../yocto/yocto_gl.h"
+#include "utils.h"
+#include "TextureWriter.h"
+
+// Options used when packing textures in atlases.
+struct AtlasOptions {
+	// textures with width and height at most maxSize are packed
+	int maxSize = 256;
+	// maximum width and height of the atlases
+	int atlasSize = 4096;
+	// pixels around every texture, copies of its edges, so that filtering does
+	// not bleed the neighbouring textures
+	int padding = 2;
+};
+
+//
+// pack_texture_atlases
+// Packs the small 8 bit textures in a few atlases (with stb_rect_pack), and
+// remaps in parallel the texture coordinates of the shapes using them. A
+// texture is packed only if its materials use no other texture, and all their
+// shapes have texture coordinates in [0, 1] (textures that wrap, for example
+// with uscale or vscale > 1, are not packed). It must not be used by the
+// environments.
+// Packed textures are removed from the scene (and from sources and images,
+// where their image files and pixels are read), atlases are saved as png next
+// to them.
+// Returns the number of textures packed.
+//
+int pack_texture_atlases(ygl::scene *scn, const AtlasOptions &opts, TextureSources *sources,
+	TextureImages *images = nullptr);
+
+#endif
@@ -0,0 +1,478 @@
+#include "TextureGraph.h"
+#include <memory>
+#include <cstring>
+#include "../yocto/ext/stb_image.h"
+#include "../yocto/ext/stb_image_resize.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TEXTUREGRAPH_SSE2
+#endif
+
+// =====================================================================================
+//                           PIXEL KERNELS
+// =====================================================================================
+
+// Kernels working on rows of n pixels (4 floats or bytes each), with the same
+// rounding as ygl::byte_to_float and ygl::float_to_byte.
+
+// byte_to_float of every byte value
+struct ByteToFloatTable {
+	float values[256];
+	ByteToFloatTable() {
+		for (int i = 0; i < 256; i++)
+			values[i] = ygl::byte_to_float((ygl::byte)i);
+	}
+};
+static const ByteToFloatTable byteToFloat;
+
+// float_to_byte(byte_to_float(a) * byte_to_float(b)), that is a * b * 256 / 255^2
+// (the same for all the byte values)
+struct ByteProductTable {
+	ygl::byte values[256][256];
+	ByteProductTable() {
+		for (int a = 0; a < 256; a++)
+			for (int b = 0; b < 256; b++)
+				values[a][b] = (ygl::byte)std::min(a * b * 256 / 65025, 255);
+	}
+};
+static const ByteProductTable *byte_products() {
+	static const ByteProductTable table;
+	return &table;
+}
+
+static void bytes_to_floats(float *dst, const ygl::byte *src, int n) {
+	for (int i = 0; i < n * 4; i++)
+		dst[i] = byteToFloat.values[src[i]];
+}
+
+static void floats_to_bytes(ygl::byte *dst, const float *src, int n) {
+	int i = 0;
+#ifdef TEXTUREGRAPH_SSE2
+	auto scale = _mm_set1_ps(256);
+	for (; i + 16 <= n * 4; i += 16) {
+		// truncation, saturated to [0, 255] by the packs
+		auto a = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), scale));
+		auto b = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale));
+		auto c = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 8), scale));
+		auto d = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 12), scale));
+		auto bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+		_mm_storeu_si128((__m128i*)(dst + i), bytes);
+	}
+#endif
+	for (; i < n * 4; i++)
+		dst[i] = ygl::float_to_byte(src[i]);
+}
+
+static void multiply_floats(float *dst, const float *a, const float *b, int n) {
+	int i = 0;
+#ifdef TEXTUREGRAPH_SSE2
+	for (; i + 4 <= n * 4; i += 4)
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+#endif
+	for (; i < n * 4; i++)
+		dst[i] = a[i] * b[i];
+}
+
+// a * t + b * (1 - t)
+static void lerp_floats(float *dst, const float *a, const float *b, float t, int n) {
+	int i = 0;
+#ifdef TEXTUREGRAPH_SSE2
+	auto ta = _mm_set1_ps(t), tb = _mm_set1_ps(1 - t);
+	for (; i + 4 <= n * 4; i += 4)
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), ta), _mm_mul_ps(_mm_loadu_ps(b + i), tb)));
+#endif
+	for (; i < n * 4; i++)
+		dst[i] = a[i] * t + b[i] * (1 - t);
+}
+
+// repeats the first n pixels of row to fill width pixels
+static void tile_row(float *row, int n, int width) {
+	for (int x = n; x < width; x += n)
+		std::memcpy(row + x * 4, row, std::min(n, width - x) * 4 * sizeof(float));
+}
+
+// =====================================================================================
+//                           EVALUATION
+// =====================================================================================
+
+//
+// TextureProgram
+// The graph of the textures being evaluated, flattened in a vector: images
+// (constant and checkerboard ones included) are leaves with their pixels,
+// operations refer to their operands by index.
+//
+struct TextureProgram {
+	struct Instruction {
+		TextureOp op = TextureOp::image;
+		int inputs[2] = { -1, -1 };
+		ygl::vec4f values[2];
+		float amount = 0;
+		int width = 1, height = 1;
+		const ygl::image4b *ldr = nullptr;
+		const ygl::image4f *hdr = nullptr;
+	};
+
+	const std::unordered_map<const ygl::texture*, TextureNode> &nodes;
+	const TextureSources *sources;
+	const TextureImages *images;
+	std::vector<Instruction> instructions;
+	std::unordered_map<const ygl::texture*, int> index;
+	// images decoded or generated for the evaluation
+	std::vector<std::unique_ptr<ygl::image4b>> ldrs;
+	std::vector<std::unique_ptr<ygl::image4f>> hdrs;
+
+	TextureProgram(const std::unordered_map<const ygl::texture*, TextureNode> &nodes, const TextureSources *sources,
+		const TextureImages *images) : nodes(nodes), sources(sources), images(images) {}
+
+	const ygl::image4b *own(ygl::image4b &&img) {
+		ldrs.push_back(std::unique_ptr<ygl::image4b>(new ygl::image4b(std::move(img))));
+		return ldrs.back().get();
+	}
+
+	// leaf with the pixels of txt (expanded to RGBA if reduced), read from its
+	// source file if not in memory
+	void set_image(Instruction &ins, const ygl::texture *txt) {
+		auto reduced = texture_image(txt, images);
+		if (!txt->ldr.empty())
+			ins.ldr = &txt->ldr;
+		else if (!txt->hdr.empty())
+			ins.hdr = &txt->hdr;
+		else if (reduced && !reduced->ldr.empty())
+			ins.ldr = own(expand_image4b(*reduced));
+		else if (reduced) {
+			hdrs.push_back(std::unique_ptr<ygl::image4f>(new ygl::image4f(expand_image4f(*reduced))));
+			ins.hdr = hdrs.back().get();
+		}
+		else if (sources && sources->count(txt)) {
+			auto &path = sources->at(txt);
+			auto ext = ygl::path_extension(path);
+			if (ext == ".hdr" || ext == ".exr") {
+				auto img = ygl::load_image4f(path);
+				if (!img.empty()) {
+					hdrs.push_back(std::unique_ptr<ygl::image4f>(new ygl::image4f(std::move(img))));
+					ins.hdr = hdrs.back().get();
+				}
+			}
+			else {
+				auto img = ygl::load_image4b(path);
+				if (!img.empty())
+					ins.ldr = own(std::move(img));
+			}
+		}
+		// missing images are black
+		if (!ins.ldr && !ins.hdr)
+			ins.ldr = own(ygl::image4b(1, 1, { 0, 0, 0, 255 }));
+	}
+
+	// index of the instruction of txt, adding it (and its operands) the first time
+	int add(const ygl::texture *txt) {
+		auto it = index.find(txt);
+		if (it != index.end())
+			return it->second;
+
+		auto ins = Instruction();
+		auto nit = nodes.find(txt);
+		if (nit == nodes.end()) {
+			set_image(ins, txt);
+		}
+		else {
+			auto &node = nit->second;
+			ins.op = node.op;
+			switch (node.op) {
+			case TextureOp::image:
+				set_image(ins, txt);
+				break;
+			case TextureOp::constant:
+				ins.ldr = own(ygl::image4b(1, 1, ygl::float_to_byte(node.values[0])));
+				break;
+			case TextureOp::checkerboard:
+				ins.ldr = own(bake_checker(node));
+				break;
+			case TextureOp::scale:
+			case TextureOp::mix:
+				ins.amount = node.amount;
+				for (int i = 0; i < 2; i++) {
+					ins.values[i] = node.values[i];
+					if (node.inputs[i]) {
+						auto input = add(node.inputs[i]);
+						ins.inputs[i] = input;
+						ins.width = std::max(ins.width, instructions[input].width);
+						ins.height = std::max(ins.height, instructions[input].height);
+					}
+				}
+				break;
+			}
+		}
+		if (ins.ldr) {
+			ins.width = ins.ldr->width();
+			ins.height = ins.ldr->height();
+		}
+		else if (ins.hdr) {
+			ins.width = ins.hdr->width();
+			ins.height = ins.hdr->height();
+		}
+		instructions.push_back(ins);
+		index[txt] = (int)instructions.size() - 1;
+		return (int)instructions.size() - 1;
+	}
+
+	// checks are flipped as texture coordinates are: the first row starts with
+	// values[1], the last one with values[0]
+	static ygl::image4b bake_checker(const TextureNode &node) {
+		auto img = ygl::image4b(node.width, node.height);
+		auto c0 = ygl::float_to_byte(node.values[0]), c1 = ygl::float_to_byte(node.values[1]);
+		auto tileWidth = std::max(1, node.width / 2), tileHeight = std::max(1, node.height / 2);
+		auto pixels = ygl::data(img);
+		parallel_for(node.height, [&](int start, int end) {
+			for (int j = start; j < end; j++)
+				for (int i = 0; i < node.width; i++)
+					pixels[(size_t)j * node.width + i] = (i / tileWidth + j / tileHeight) % 2 ? c0 : c1;
+		}, 64);
+		return img;
+	}
+
+	//
+	// Rows
+	// Buffers of a thread evaluating rows: for each instruction its row and the
+	// ones of its operands (tiled to its width, or filled with its constants).
+	//
+	struct Rows {
+		std::vector<std::vector<float>> values, operands[2];
+		Rows(const TextureProgram &program) {
+			auto n = program.instructions.size();
+			values.resize(n);
+			operands[0].resize(n);
+			operands[1].resize(n);
+			for (size_t i = 0; i < n; i++) {
+				auto &ins = program.instructions[i];
+				if (ins.hdr) continue;
+				values[i].resize(ins.width * 4);
+				if (ins.ldr) continue;
+				for (int k = 0; k < 2; k++) {
+					operands[k][i].resize(ins.width * 4);
+					if (ins.inputs[k] < 0)
+						for (int x = 0; x < ins.width; x++)
+							std::memcpy(&operands[k][i][x * 4], &ins.values[k], 4 * sizeof(float));
+				}
+			}
+		}
+	};
+
+	// row y of instruction i (width pixels)
+	const float *row(int i, int y, Rows &rows) const {
+		auto &ins = instructions[i];
+		if (ins.hdr)
+			return (const float*)ygl::data(*ins.hdr) + (size_t)y * ins.width * 4;
+		auto dst = rows.values[i].data();
+		if (ins.ldr) {
+			bytes_to_floats(dst, (const ygl::byte*)ygl::data(*ins.ldr) + (size_t)y * ins.width * 4, ins.width);
+			return dst;
+		}
+		const float *operands[2];
+		for (int k = 0; k < 2; k++) {
+			auto input = ins.inputs[k];
+			auto buffer = rows.operands[k][i].data();
+			operands[k] = buffer;
+			if (input < 0)
+				continue;
+			auto &in = instructions[input];
+			auto src = row(input, y % in.height, rows);
+			// the row of operand 0 is copied, as operand 1 may share instructions
+			// with it and rewrite their rows for another y; hdr rows are the
+			// image itself
+			if (in.width == ins.width && (k == 1 || in.hdr)) {
+				operands[k] = src;
+				continue;
+			}
+			std::memcpy(buffer, src, in.width * 4 * sizeof(float));
+			tile_row(buffer, in.width, ins.width);
+		}
+		if (ins.op == TextureOp::scale)
+			multiply_floats(dst, operands[0], operands[1], ins.width);
+		else
+			lerp_floats(dst, operands[0], operands[1], ins.amount, ins.width);
+		return dst;
+	}
+
+	// true if instruction i combines 8 bit images (or constants) of its own size,
+	// computed directly on bytes
+	bool byte_operands(int i) const {
+		auto &ins = instructions[i];
+		if (ins.ldr || ins.hdr)
+			return false;
+		for (int k = 0; k < 2; k++) {
+			auto input = ins.inputs[k];
+			if (input >= 0 && (!instructions[input].ldr || instructions[input].width != ins.width ||
+				instructions[input].height != ins.height))
+				return false;
+		}
+		return ins.inputs[0] >= 0 || ins.inputs[1] >= 0;
+	}
+
+	// row y of instruction i, with byte_operands(i), computed with tables giving
+	// the same results as the float evaluation
+	void byte_row(int i, int y, ygl::byte *dst) const {
+		auto &ins = instructions[i];
+		const ygl::byte *src[2] = { nullptr, nullptr };
+		for (int k = 0; k < 2; k++)
+			if (ins.inputs[k] >= 0)
+				src[k] = (const ygl::byte*)ygl::data(*instructions[ins.inputs[k]].ldr) + (size_t)y * ins.width * 4;
+		auto n = ins.width * 4;
+		if (ins.op == TextureOp::scale && src[0] && src[1]) {
+			auto &products = byte_products()->values;
+			for (int j = 0; j < n; j++)
+				dst[j] = products[src[0][j]][src[1][j]];
+		}
+		else if (ins.op == TextureOp::scale) {
+			// image times constant
+			auto k = src[0] ? 0 : 1;
+			ygl::byte table[4][256];
+			for (int c = 0; c < 4; c++)
+				for (int v = 0; v < 256; v++)
+					table[c][v] = ygl::float_to_byte(byteToFloat.values[v] * (&ins.values[1 - k].x)[c]);
+			for (int j = 0; j < n; j++)
+				dst[j] = table[j & 3][src[k][j]];
+		}
+		else {
+			// weighted terms of the two operands, summed
+			float terms[2][4][256];
+			float weights[2] = { ins.amount, 1 - ins.amount };
+			for (int k = 0; k < 2; k++)
+				for (int c = 0; c < 4; c++)
+					for (int v = 0; v < 256; v++)
+						terms[k][c][v] = (src[k] ? byteToFloat.values[v] : (&ins.values[k].x)[c]) * weights[k];
+			for (int j = 0; j < n; j++)
+				dst[j] = ygl::float_to_byte(terms[0][j & 3][src[0] ? src[0][j] : 0] + terms[1][j & 3][src[1] ? src[1][j] : 0]);
+		}
+	}
+};
+
+void TextureGraph::evaluate(const std::vector<ygl::texture*> &textures, const TextureSources *sources,
+	TextureImages *images) {
+	TextureProgram program(nodes, sources, images);
+	auto roots = std::vector<std::pair<ygl::texture*, int>>();
+	for (auto txt : textures)
+		if (derived(txt))
+			roots.push_back(std::make_pair(txt, program.add(txt)));
+
+	for (auto &root : roots) {
+		auto txt = root.first;
+		auto &ins = program.instructions[root.second];
+		if (ins.ldr) {
+			// constant or checkerboard
+			txt->ldr = *ins.ldr;
+			if (images)
+				reduce_texture(txt, *images);
+			continue;
+		}
+		auto img = ygl::image4b(ins.width, ins.height);
+		auto pixels = (ygl::byte*)ygl::data(img);
+		auto bytes = program.byte_operands(root.second);
+		parallel_for(ins.height, [&](int start, int end) {
+			if (bytes) {
+				for (int y = start; y < end; y++)
+					program.byte_row(root.second, y, pixels + (size_t)y * ins.width * 4);
+				return;
+			}
+			TextureProgram::Rows rows(program);
+			for (int y = start; y < end; y++)
+				floats_to_bytes(pixels + (size_t)y * ins.width * 4, program.row(root.second, y, rows), ins.width);
+		}, 16);
+		txt->ldr = std::move(img);
+		if (images)
+			reduce_texture(txt, *images);
+	}
+}
+
+uint64_t hash_texture_node(const TextureNode &node) {
+	auto h = hash_bytes(&node.op, sizeof(node.op));
+	h = hash_bytes(node.inputs, sizeof(node.inputs), h);
+	h = hash_bytes(node.values, sizeof(node.values), h);
+	h = hash_bytes(&node.amount, sizeof(node.amount), h);
+	h = hash_bytes(&node.width, sizeof(node.width), h);
+	return hash_bytes(&node.height, sizeof(node.height), h);
+}
+
+bool same_texture_node(const TextureNode &a, const TextureNode &b) {
+	auto same = a.op == b.op && a.amount == b.amount && a.width == b.width && a.height == b.height;
+	for (int i = 0; i < 2; i++)
+		same = same && a.inputs[i] == b.inputs[i] && a.values[i].x == b.values[i].x &&
+			a.values[i].y == b.values[i].y && a.values[i].z == b.values[i].z && a.values[i].w == b.values[i].w;
+	return same;
+}
+
+// =====================================================================================
+//                           DOWNSCALING
+// =====================================================================================
+
+// size after halving until it fits in maxSize
+static void downscaled_size(int width, int height, int maxSize, int &w, int &h) {
+	w = width;
+	h = height;
+	while (w > maxSize || h > maxSize) {
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+	}
+}
+
+// resizes in bands of rows on different threads (the same as resizing at once)
+static void parallel_resize(const void *input, int width, int height, void *output, int w, int h,
+	stbir_datatype type, stbir_colorspace space) {
+	auto pixelSize = type == STBIR_TYPE_FLOAT ? 4 * sizeof(float) : 4;
+	parallel_for(h, [&](int start, int end) {
+		stbir_resize_subpixel(input, width, height, width * pixelSize,
+			(char*)output + (size_t)start * w * pixelSize, w, end - start, w * pixelSize,
+			type, 4, 3, 0, STBIR_EDGE_WRAP, STBIR_EDGE_WRAP, STBIR_FILTER_DEFAULT, STBIR_FILTER_DEFAULT,
+			space, nullptr, (float)w / width, (float)h / height, 0, (float)start);
+	}, 64);
+}
+
+ygl::image4b downscale_image(const ygl::image4b &img, int maxSize) {
+	int w, h;
+	downscaled_size(img.width(), img.height(), maxSize, w, h);
+	if (w == img.width() && h == img.height())
+		return img;
+	auto res = ygl::image4b(w, h);
+	parallel_resize(ygl::data(img), img.width(), img.height(), ygl::data(res), w, h,
+		STBIR_TYPE_UINT8, STBIR_COLORSPACE_SRGB);
+	return res;
+}
+
+ygl::image4f downscale_image(const ygl::image4f &img, int maxSize) {
+	int w, h;
+	downscaled_size(img.width(), img.height(), maxSize, w, h);
+	if (w == img.width() && h == img.height())
+		return img;
+	auto res = ygl::image4f(w, h);
+	parallel_resize(ygl::data(img), img.width(), img.height(), ygl::data(res), w, h,
+		STBIR_TYPE_FLOAT, STBIR_COLORSPACE_LINEAR);
+	return res;
+}
+
+bool load_downscaled_texture(ygl::texture *txt, const std::string &filename, int maxSize) {
+	auto ext = ygl::path_extension(filename);
+	if (ext == ".exr") {
+		// no header only query: decoded to know the size
+		auto img = ygl::load_image4f(filename);
+		if (img.empty() || (img.width() <= maxSize && img.height() <= maxSize))
+			return false;
+		txt->hdr = downscale_image(img, maxSize);
+		return true;
+	}
+	int width, height, ncomp;
+	if (!stbi_info(filename.c_str(), &width, &height, &ncomp) || (width <= maxSize && height <= maxSize))
+		return false;
+	if (ext == ".hdr") {
+		auto img = ygl::load_image4f(filename);
+		if (img.empty())
+			return false;
+		txt->hdr = downscale_image(img, maxSize);
+	}
+	else {
+		auto img = ygl::load_image4b(filename);
+		if (img.empty())
+			return false;
+		txt->ldr = downscale_image(img, maxSize);
+	}
+	return true;
+}
@@ -0,0 +1,83 @@
+#ifndef __TEXTUREGRAPH__
+#define __TEXTUREGRAPH__
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "../yocto/yocto_gl.h"
+#include "utils.h"
+#include "TextureWriter.h"
+
+// Operation computing the pixels of a texture.
+enum struct TextureOp { image, constant, checkerboard, scale, mix };
+
+//
+// TextureNode
+// A texture defined as an operation. Operands are the textures in inputs, or
+// the constants in values when inputs[i] is null:
+// - image: the pixels of the texture, or of its source file (no node needed)
+// - constant: values[0], in a 1x1 image
+// - checkerboard: width x height image with 2 x 2 checks of values[0] and
+//   values[1] (flipped, as texture coordinates are)
+// - scale: operand 0 * operand 1
+// - mix: operand 0 * amount + operand 1 * (1 - amount)
+// Smaller operands are tiled over the bigger one.
+//
+struct TextureNode {
+	TextureOp op = TextureOp::image;
+	const ygl::texture *inputs[2] = { nullptr, nullptr };
+	ygl::vec4f values[2] = { { 1, 1, 1, 1 }, { 1, 1, 1, 1 } };
+	float amount = 0.5f;
+	int width = 128, height = 128;
+};
+
+// hash and comparison of the parameters of nodes, to find identical textures
+uint64_t hash_texture_node(const TextureNode &node);
+bool same_texture_node(const TextureNode &a, const TextureNode &b);
+
+//
+// TextureGraph
+// Textures of a scene kept as operations on other textures, whose pixels are
+// computed only for the textures actually used, evaluating chains of
+// operations a row at a time without intermediate images.
+//
+class TextureGraph {
+	std::unordered_map<const ygl::texture*, TextureNode> nodes;
+
+	public:
+	// defines (or redefines) the operation of a texture
+	void set(const ygl::texture *txt, const TextureNode &node) { nodes[txt] = node; }
+	// true for textures computed from others (or from values)
+	bool derived(const ygl::texture *txt) const { return txt && nodes.count(txt) > 0; }
+	const TextureNode &node(const ygl::texture *txt) const { return nodes.at(txt); }
+	void remove(const ygl::texture *txt) { nodes.erase(txt); }
+
+	//
+	// evaluate
+	// Computes the (ldr) pixels of the derived textures among the given ones,
+	// splitting their rows among threads. The images they use are read once, from their pixels
+	// (in the textures or in images) or from sources, and released at the end. With images, the
+	// computed pixels are moved there (see reduce_texture) as soon as each texture is done.
+	//
+	void evaluate(const std::vector<ygl::texture*> &textures, const TextureSources *sources,
+		TextureImages *images = nullptr);
+};
+
+//
+// downscale_image
+// Halves the image (as the levels of a mipmap) until its width and height are
+// at most maxSize, filtering in linear space (8 bit images are sRGB) and
+// wrapping around the edges, as textures are tiled. Rows of the result are
+// computed in parallel.
+//
+ygl::image4b downscale_image(const ygl::image4b &img, int maxSize);
+ygl::image4f downscale_image(const ygl::image4f &img, int maxSize);
+
+//
+// load_downscaled_texture
+// If the image file is bigger than maxSize, loads its pixels in txt, downscaled
+// with downscale_image, and returns true. Returns false for smaller (or
+// unreadable) images.
+//
+bool load_downscaled_texture(ygl::texture *txt, const std::string &filename, int maxSize);
+
+#endif
@@ -0,0 +1,458 @@
+#include "TextureWriter.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "../yocto/ext/tinyexr.h"
+
+// deflate encoder of stb_image_write (compiled in yocto)
+unsigned char *stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality);
+
+// =====================================================================================
+//                           PNG
+// =====================================================================================
+
+// crc32 table of png chunks
+struct CRCTable {
+	uint32_t values[256];
+	CRCTable() {
+		for (uint32_t n = 0; n < 256; n++) {
+			auto c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			values[n] = c;
+		}
+	}
+};
+static const CRCTable crcTable;
+
+static void put_be32(std::vector<uint8_t> &out, uint32_t v) {
+	out.push_back(uint8_t(v >> 24));
+	out.push_back(uint8_t(v >> 16));
+	out.push_back(uint8_t(v >> 8));
+	out.push_back(uint8_t(v));
+}
+
+// appends a chunk (length, type, data, crc of type and data)
+static void put_png_chunk(std::vector<uint8_t> &out, const char *type, const uint8_t *data, size_t size) {
+	put_be32(out, (uint32_t)size);
+	auto start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	uint32_t crc = 0xffffffffu;
+	for (auto i = start; i < out.size(); i++)
+		crc = crcTable.values[(crc ^ out[i]) & 0xff] ^ (crc >> 8);
+	put_be32(out, crc ^ 0xffffffffu);
+}
+
+static inline uint8_t paeth(int a, int b, int c) {
+	int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+	if (pa <= pb && pa <= pc) return uint8_t(a);
+	if (pb <= pc) return uint8_t(b);
+	return uint8_t(c);
+}
+
+// fast png encoding: paeth filter on every row, short deflate match chains
+static bool write_png_fast(const std::string &filename, int width, int height, int ncomp, const ygl::byte *pixels) {
+	static const uint8_t colorTypes[5] = {0, 0, 4, 2, 6};
+	if (ncomp < 1 || ncomp > 4 || width <= 0 || height <= 0) return false;
+	auto stride = (size_t)width * ncomp;
+	if ((stride + 1) * height > (size_t)INT32_MAX) return false;
+
+	auto filtered = std::vector<uint8_t>((stride + 1) * height);
+	for (int j = 0; j < height; j++) {
+		auto row = pixels + j * stride;
+		auto prev = j ? row - stride : nullptr;
+		auto dst = filtered.data() + j * (stride + 1);
+		*dst++ = 4;
+		for (size_t i = 0; i < stride; i++) {
+			int a = (i >= (size_t)ncomp) ? row[i - ncomp] : 0;
+			int b = prev ? prev[i] : 0;
+			int c = (prev && i >= (size_t)ncomp) ? prev[i - ncomp] : 0;
+			dst[i] = uint8_t(row[i] - paeth(a, b, c));
+		}
+	}
+	int zlen = 0;
+	auto zlib = stbi_zlib_compress(filtered.data(), (int)filtered.size(), &zlen, 5);
+	std::vector<uint8_t>().swap(filtered);
+	if (!zlib) return false;
+
+	static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	auto out = std::vector<uint8_t>(signature, signature + 8);
+	out.reserve(zlen + 64);
+	auto ihdr = std::vector<uint8_t>();
+	put_be32(ihdr, width);
+	put_be32(ihdr, height);
+	ihdr.insert(ihdr.end(), {8, colorTypes[ncomp], 0, 0, 0});
+	put_png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+	put_png_chunk(out, "IDAT", zlib, zlen);
+	std::free(zlib);
+	put_png_chunk(out, "IEND", nullptr, 0);
+
+	auto f = fopen(filename.c_str(), "wb");
+	if (!f) return false;
+	auto ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+	return fclose(f) == 0 && ok;
+}
+
+bool write_png(const std::string &filename, int width, int height, int ncomp,
+	const ygl::byte *pixels, bool fast) {
+	if (fast)
+		return write_png_fast(filename, width, height, ncomp, pixels);
+	return ygl::save_image(filename, width, height, ncomp, pixels);
+}
+
+// =====================================================================================
+//                           EXR
+// =====================================================================================
+
+bool write_exr(const std::string &filename, int width, int height, int ncomp, const float *pixels,
+	bool half, EXRCompression compression, std::string *error) {
+	// channels are stored by name, in alphabetical order
+	static const char *names[5][4] = { {}, {}, {}, { "B", "G", "R" }, { "A", "B", "G", "R" } };
+	static const int order[5][4] = { {}, {}, {}, { 2, 1, 0 }, { 3, 2, 1, 0 } };
+	if ((ncomp != 3 && ncomp != 4) || width <= 0 || height <= 0) {
+		if (error) *error = "invalid exr image size or channels";
+		return false;
+	}
+
+	auto size = (size_t)width * height;
+	std::vector<std::vector<float>> planes(ncomp, std::vector<float>(size));
+	std::vector<unsigned char*> images(ncomp);
+	std::vector<EXRChannelInfo> channels(ncomp);
+	std::vector<int> types(ncomp, TINYEXR_PIXELTYPE_FLOAT), storedTypes(ncomp);
+	for (int c = 0; c < ncomp; c++) {
+		auto &plane = planes[c];
+		auto src = pixels + order[ncomp][c];
+		auto fitsHalf = half;
+		for (size_t i = 0; i < size; i++) {
+			plane[i] = src[i * ncomp];
+			fitsHalf = fitsHalf && std::abs(plane[i]) <= 65504.0f;
+		}
+		storedTypes[c] = fitsHalf ? TINYEXR_PIXELTYPE_HALF : TINYEXR_PIXELTYPE_FLOAT;
+		images[c] = (unsigned char*)plane.data();
+		std::memset(&channels[c], 0, sizeof(EXRChannelInfo));
+		std::strcpy(channels[c].name, names[ncomp][c]);
+	}
+
+	EXRHeader header;
+	InitEXRHeader(&header);
+	header.num_channels = ncomp;
+	header.channels = channels.data();
+	header.pixel_types = types.data();
+	header.requested_pixel_types = storedTypes.data();
+	header.compression_type = (int)compression;
+	EXRImage image;
+	InitEXRImage(&image);
+	image.num_channels = ncomp;
+	image.images = images.data();
+	image.width = width;
+	image.height = height;
+	// the messages of the tinyexr bundled with yocto are static strings, not
+	// to be freed (it has no FreeEXRErrorMessage)
+	const char *err = nullptr;
+	if (SaveEXRImageToFile(&image, &header, filename.c_str(), &err) == TINYEXR_SUCCESS)
+		return true;
+	if (error) *error = err ? err : "cannot save exr image";
+	return false;
+}
+
+// =====================================================================================
+//                           TEXTURES
+// =====================================================================================
+
+int image_channels(const ygl::image4b &img) {
+	bool gray = true, opaque = true;
+	for (auto &p : img.pixels) {
+		gray = gray && p.x == p.y && p.x == p.z;
+		opaque = opaque && p.w == 255;
+		if (!gray && !opaque) break;
+	}
+	return gray ? (opaque ? 1 : 2) : (opaque ? 3 : 4);
+}
+
+int image_channels(const ygl::image4f &img) {
+	for (auto &p : img.pixels)
+		if (p.w != 1) return 4;
+	return 3;
+}
+
+// the first ncomp components of every pixel (gray and alpha for 2)
+template <typename T>
+static std::vector<T> pack_channels(const T *pixels, size_t size, int ncomp) {
+	auto packed = std::vector<T>(size * ncomp);
+	for (size_t i = 0; i < size; i++)
+		for (int c = 0; c < ncomp; c++)
+			packed[i * ncomp + c] = pixels[i * 4 + (ncomp == 2 && c == 1 ? 3 : c)];
+	return packed;
+}
+
+// inverse of pack_channels, one is the value of the missing alpha
+template <typename T>
+static void unpack_channels(const T *packed, size_t size, int ncomp, T one, T *pixels) {
+	for (size_t i = 0; i < size; i++) {
+		auto src = packed + i * ncomp;
+		auto dst = pixels + i * 4;
+		for (int c = 0; c < 3; c++)
+			dst[c] = src[ncomp < 3 ? 0 : c];
+		dst[3] = (ncomp == 2 || ncomp == 4) ? src[ncomp - 1] : one;
+	}
+}
+
+void reduce_texture(ygl::texture *txt, TextureImages &images) {
+	auto img = TextureImage();
+	if (!txt->ldr.empty()) {
+		img.width = txt->ldr.width();
+		img.height = txt->ldr.height();
+		img.ncomp = image_channels(txt->ldr);
+		img.ldr = pack_channels((const ygl::byte*)ygl::data(txt->ldr), txt->ldr.pixels.size(), img.ncomp);
+		txt->ldr = ygl::image4b();
+	}
+	else if (!txt->hdr.empty()) {
+		img.width = txt->hdr.width();
+		img.height = txt->hdr.height();
+		img.ncomp = image_channels(txt->hdr);
+		img.hdr = pack_channels((const float*)ygl::data(txt->hdr), txt->hdr.pixels.size(), img.ncomp);
+		txt->hdr = ygl::image4f();
+	}
+	else {
+		return;
+	}
+	images[txt] = std::move(img);
+}
+
+const TextureImage *texture_image(const ygl::texture *txt, const TextureImages *images) {
+	if (!images)
+		return nullptr;
+	auto it = images->find(txt);
+	return (it != images->end()) ? &it->second : nullptr;
+}
+
+ygl::image4b expand_image4b(const TextureImage &img) {
+	auto res = ygl::image4b(img.width, img.height);
+	unpack_channels(img.ldr.data(), res.pixels.size(), img.ncomp, (ygl::byte)255, (ygl::byte*)ygl::data(res));
+	return res;
+}
+
+ygl::image4f expand_image4f(const TextureImage &img) {
+	auto res = ygl::image4f(img.width, img.height);
+	unpack_channels(img.hdr.data(), res.pixels.size(), img.ncomp, 1.0f, (float*)ygl::data(res));
+	return res;
+}
+
+void expand_textures(ygl::scene *scn, TextureImages &images) {
+	for (auto txt : scn->textures) {
+		auto it = images.find(txt);
+		if (it == images.end())
+			continue;
+		if (!it->second.ldr.empty())
+			txt->ldr = expand_image4b(it->second);
+		else
+			txt->hdr = expand_image4f(it->second);
+		images.erase(it);
+	}
+}
+
+// unique name for a temporary file next to filename
+static std::string temporary_filename(const std::string &filename) {
+	static std::atomic<unsigned> counter(0);
+#ifndef _WIN32
+	return filename + ".tmp" + std::to_string(getpid()) + "_" + std::to_string(counter++);
+#else
+	return filename + ".tmp" + std::to_string(counter++);
+#endif
+}
+
+// moves tmp over filename (removing tmp if it fails)
+static bool replace_file(const std::string &tmp, const std::string &filename) {
+#ifdef _WIN32
+	std::remove(filename.c_str());
+#endif
+	if (std::rename(tmp.c_str(), filename.c_str()) == 0) return true;
+	std::remove(tmp.c_str());
+	return false;
+}
+
+bool copy_image_file(const std::string &source, const std::string &filename, bool link) {
+#ifndef _WIN32
+	struct stat ss, fs;
+	if (stat(source.c_str(), &ss) != 0) return false;
+	if (stat(filename.c_str(), &fs) == 0 && ss.st_dev == fs.st_dev && ss.st_ino == fs.st_ino)
+		return true;
+	if (link) {
+		auto tmp = temporary_filename(filename);
+		if (::link(source.c_str(), tmp.c_str()) == 0)
+			return replace_file(tmp, filename);
+	}
+#else
+	if (source == filename) return true;
+#endif
+	// the copy is written in a new file, that then replaces the destination:
+	// an existing destination (maybe a link to the source) is never written
+	auto in = fopen(source.c_str(), "rb");
+	if (!in) return false;
+	auto tmp = temporary_filename(filename);
+	auto out = fopen(tmp.c_str(), "wb");
+	if (!out) {
+		fclose(in);
+		return false;
+	}
+	auto buffer = std::vector<char>(1 << 20);
+	auto ok = true;
+	for (size_t n; ok && (n = fread(buffer.data(), 1, buffer.size(), in)) > 0; )
+		ok = fwrite(buffer.data(), 1, n, out) == n;
+	ok = ok && !ferror(in);
+	fclose(in);
+	ok = fclose(out) == 0 && ok;
+	if (!ok) {
+		std::remove(tmp.c_str());
+		return false;
+	}
+	return replace_file(tmp, filename);
+}
+
+// file of a texture saved in dirname
+static std::string texture_filename(const ygl::texture *txt, const std::string &dirname) {
+	auto filename = dirname + txt->path;
+	for (auto &c : filename)
+		if (c == '\\') c = '/';
+	return filename;
+}
+
+// saves ncomp channels: png and jpg with all of them, exr with 3 or 4, hdr
+// ignoring the alpha
+static bool write_image(const std::string &filename, int width, int height, int ncomp,
+	const ygl::byte *pixels, const TextureSaveOptions &opts, std::string * /*error*/) {
+	if (ygl::path_extension(filename) == ".png")
+		return write_png(filename, width, height, ncomp, pixels, opts.fastPNG);
+	return ygl::save_image(filename, width, height, ncomp, pixels);
+}
+
+static bool write_image(const std::string &filename, int width, int height, int ncomp,
+	const float *pixels, const TextureSaveOptions &opts, std::string *error) {
+	if (ygl::path_extension(filename) == ".exr")
+		return write_exr(filename, width, height, ncomp, pixels, opts.halfEXR, opts.exrCompression, error);
+	return ygl::save_imagef(filename, width, height, ncomp, pixels);
+}
+
+// saves the first ncomp channels of RGBA pixels (see pack_channels)
+template <typename T>
+static bool write_rgba_image(const std::string &filename, int width, int height, int ncomp,
+	const T *pixels, const TextureSaveOptions &opts, std::string *error) {
+	if (ncomp == 4)
+		return write_image(filename, width, height, 4, pixels, opts, error);
+	auto packed = pack_channels(pixels, (size_t)width * height, ncomp);
+	return write_image(filename, width, height, ncomp, packed.data(), opts, error);
+}
+
+bool write_texture(const ygl::texture *txt, const std::string &dirname, const TextureSaveOptions &opts,
+	std::string *error) {
+	auto filename = texture_filename(txt, dirname);
+	auto img = texture_image(txt, opts.images);
+	if (img && !img->ldr.empty())
+		return write_image(filename, img->width, img->height, img->ncomp, img->ldr.data(), opts, error);
+	if (img)
+		return write_image(filename, img->width, img->height, img->ncomp, img->hdr.data(), opts, error);
+	if (!txt->ldr.empty())
+		return write_rgba_image(filename, txt->ldr.width(), txt->ldr.height(), image_channels(txt->ldr),
+			(const ygl::byte*)ygl::data(txt->ldr), opts, error);
+	if (!txt->hdr.empty())
+		return write_rgba_image(filename, txt->hdr.width(), txt->hdr.height(), image_channels(txt->hdr),
+			(const float*)ygl::data(txt->hdr), opts, error);
+	if (opts.sources) {
+		auto it = opts.sources->find(txt);
+		if (it != opts.sources->end())
+			return copy_image_file(it->second, filename, opts.linkSources);
+	}
+	return false;
+}
+
+//
+// EncodingBudget
+// Bytes of the images being encoded; a new one waits until it fits, or until
+// nothing else is in progress.
+//
+class EncodingBudget {
+	std::mutex mutex;
+	std::condition_variable freed;
+	size_t budget, used = 0;
+
+	public:
+	EncodingBudget(size_t budget) : budget(budget) {}
+
+	void acquire(size_t bytes) {
+		if (!budget) return;
+		std::unique_lock<std::mutex> lock(mutex);
+		freed.wait(lock, [&]() { return used == 0 || used + bytes <= budget; });
+		used += bytes;
+	}
+	void release(size_t bytes) {
+		if (!budget) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			used -= bytes;
+		}
+		freed.notify_all();
+	}
+};
+
+// memory used while encoding a texture: png keeps the filtered image, its
+// compressed copy and the file in memory, exr the channels and the compressed
+// ones, hdr is encoded a line at a time (and copies of source files use a
+// small buffer)
+static size_t encoding_bytes(const ygl::texture *txt, const TextureSaveOptions &opts) {
+	auto img = texture_image(txt, opts.images);
+	auto hdr = (img) ? !img->hdr.empty() : txt->ldr.empty();
+	auto width = (size_t)((img) ? img->width : (hdr) ? txt->hdr.width() : txt->ldr.width());
+	auto height = (size_t)((img) ? img->height : (hdr) ? txt->hdr.height() : txt->ldr.height());
+	auto ncomp = (size_t)((img) ? img->ncomp : 4);
+	if (!hdr)
+		return width * height * ncomp * 3;
+	if (ygl::path_extension(txt->path) == ".exr")
+		return width * height * ncomp * sizeof(float) * 2;
+	return width * height * 4;
+}
+
+void write_textures(const ygl::scene *scn, const std::string &dirname, const TextureSaveOptions &opts) {
+	auto textures = std::vector<const ygl::texture*>();
+	for (auto txt : scn->textures)
+		if (!txt->ldr.empty() || !txt->hdr.empty() || texture_image(txt, opts.images) ||
+			(opts.sources && opts.sources->count(txt)))
+			textures.push_back(txt);
+
+	// every file is written once, by a single task: textures can share a path
+	// (load_texture names them by basename), the last one is saved, as it
+	// would be writing them in order
+	auto lastWriter = std::unordered_map<std::string, int>();
+	for (auto i = 0; i < (int)textures.size(); i++)
+		lastWriter[texture_filename(textures[i], dirname)] = i;
+	auto writers = std::vector<int>();
+	for (auto i = 0; i < (int)textures.size(); i++)
+		if (lastWriter.at(texture_filename(textures[i], dirname)) == i)
+			writers.push_back(i);
+
+	EncodingBudget budget(opts.memoryBudget);
+	auto saved = std::vector<uint8_t>(textures.size(), 0);
+	auto errors = std::vector<std::string>(textures.size());
+	parallel_tasks((int)writers.size(), [&](int w) {
+		auto i = writers[w];
+		auto bytes = encoding_bytes(textures[i], opts);
+		budget.acquire(bytes);
+		saved[i] = write_texture(textures[i], dirname, opts, &errors[i]);
+		budget.release(bytes);
+	}, opts.threads);
+
+	if (opts.skipMissing) return;
+	for (auto i : writers)
+		if (!saved[i])
+			throw std::runtime_error("cannot save image " + dirname + textures[i]->path +
+				(errors[i].empty() ? "" : ": " + errors[i]));
+}
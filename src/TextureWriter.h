@@ -0,0 +1,147 @@
+#ifndef __TEXTUREWRITER__
+#define __TEXTUREWRITER__
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <stdexcept>
+#include "../yocto/yocto_gl.h"
+#include "utils.h"
+
+//
+// TextureSources
+// Image files of the textures that are used as they are: their pixels are not
+// kept in memory (unless needed to derive other textures), and the files are
+// copied instead of decoded and encoded again.
+//
+typedef std::unordered_map<const ygl::texture*, std::string> TextureSources;
+
+//
+// TextureImage
+// Pixels of a texture with only the channels they use (see image_channels):
+// ncomp 8 bit (ldr) or float (hdr) values per pixel, row by row. A gray
+// texture takes a quarter of the memory of its RGBA image.
+//
+struct TextureImage {
+	int width = 0, height = 0, ncomp = 0;
+	std::vector<ygl::byte> ldr;
+	std::vector<float> hdr;
+};
+
+//
+// TextureImages
+// Pixels of the textures kept in memory (computed or downscaled ones), moved
+// out of the RGBA images of their ygl::texture by reduce_texture.
+//
+typedef std::unordered_map<const ygl::texture*, TextureImage> TextureImages;
+
+// Compression of the exr images (the values of tinyexr).
+enum struct EXRCompression { none = 0, rle = 1, zips = 2, zip = 3, piz = 4 };
+
+// Options used when saving the texture images of a scene.
+struct TextureSaveOptions {
+	// do not fail on images that cannot be saved
+	bool skipMissing = true;
+	// faster png compression, with bigger files
+	bool fastPNG = false;
+	// threads encoding the images, 0 to use all the cores
+	int threads = 0;
+	// (estimated) bytes used by the images being encoded at the same time,
+	// 0 for no limit
+	size_t memoryBudget = size_t(512) << 20;
+	// source files of the textures without pixels (if any)
+	const TextureSources *sources = nullptr;
+	// pixels of the textures kept with the channels they use (if any)
+	const TextureImages *images = nullptr;
+	// hard link the source files instead of copying them (when possible)
+	bool linkSources = false;
+	// exr images are saved with half floats (unless a value does not fit),
+	// and compressed
+	bool halfEXR = true;
+	EXRCompression exrCompression = EXRCompression::zip;
+};
+
+//
+// write_png
+// Saves an 8 bit image as png. With fast, every row is paeth filtered and
+// deflated with short match searches, instead of trying all the filters as
+// stb does: it is faster, for slightly bigger files.
+//
+bool write_png(const std::string &filename, int width, int height, int ncomp,
+	const ygl::byte *pixels, bool fast);
+
+//
+// write_exr
+// Saves a float image as OpenEXR, with 3 (RGB) or 4 (RGBA) channels. With half,
+// channels are stored as half floats, unless some value is too big for them.
+// If it fails, the reason (given by tinyexr) is set in error, when not null.
+//
+bool write_exr(const std::string &filename, int width, int height, int ncomp, const float *pixels,
+	bool half = true, EXRCompression compression = EXRCompression::zip, std::string *error = nullptr);
+
+//
+// image_channels
+// Channels really used by an image: 1 if it is gray and opaque, 2 if it is gray,
+// 3 if it is opaque, 4 otherwise. Float images are only 3 or 4 channels: exr
+// readers built on tinyexr (as yocto) need the R, G and B channels.
+//
+int image_channels(const ygl::image4b &img);
+int image_channels(const ygl::image4f &img);
+
+//
+// reduce_texture
+// Moves the pixels of txt in images, keeping the channels they use (see
+// image_channels): txt is left without pixels. Nothing to do for textures
+// without pixels.
+//
+void reduce_texture(ygl::texture *txt, TextureImages &images);
+
+// image of txt in images, null if it has none (or images is null)
+const TextureImage *texture_image(const ygl::texture *txt, const TextureImages *images);
+
+//
+// expand_image4b, expand_image4f
+// RGBA pixels of an image of a texture: gray values are repeated in R, G and
+// B, and pixels without alpha are opaque.
+//
+ygl::image4b expand_image4b(const TextureImage &img);
+ygl::image4f expand_image4f(const TextureImage &img);
+
+//
+// expand_textures
+// Moves back the pixels of the textures of the scene found in images in their
+// ygl::texture (as RGBA images), for code reading them from there.
+//
+void expand_textures(ygl::scene *scn, TextureImages &images);
+
+//
+// copy_image_file
+// Copies (or hard links) an image file, nothing to do if they are the same file.
+// The copy (or link) is made under a temporary name and renamed over filename,
+// so an existing filename is replaced, never written through.
+//
+bool copy_image_file(const std::string &source, const std::string &filename, bool link);
+
+//
+// write_texture
+// Saves the image of a texture in dirname + txt->path, encoding its pixels (from
+// opts.images, or the texture) or, without them, copying its source file. Images
+// are saved with the channels they really use (see image_channels). Returns false
+// if the texture has neither or the image cannot be saved, setting the reason in
+// error (when not null and known).
+//
+bool write_texture(const ygl::texture *txt, const std::string &dirname, const TextureSaveOptions &opts,
+	std::string *error = nullptr);
+
+//
+// write_textures
+// Saves the textures of the scene in dirname, at their (relative) paths, from
+// their pixels or their source files. Images are encoded in parallel, starting
+// a new one only while the memory needed by the ones in progress fits in the
+// budget. Textures with the same path are saved once, from the last of them.
+// Unless skipMissing, throws (after all the others have been saved) for the
+// first texture that could not be saved, with the reason when known.
+//
+void write_textures(const ygl::scene *scn, const std::string &dirname, const TextureSaveOptions &opts);
+
+#endif
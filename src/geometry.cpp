@@ -0,0 +1,602 @@
+#include "geometry.h"
+
+//
+// compute_vertex_normals
+// Computes per vertex normals of a triangle mesh, following pbrt winding.
+//
+void compute_vertex_normals(const std::vector<ygl::vec3i>& triangles,
+	const std::vector<ygl::vec3f>& pos, std::vector<ygl::vec3f>& norm, bool weighted) {
+
+	int nverts = (int)pos.size();
+	int nfaces = (int)triangles.size();
+	norm.assign(nverts, ygl::zero3f);
+	if (nverts == 0 || nfaces == 0)
+		return;
+
+	// step 1: face normals, stored as separate x, y, z arrays
+	std::vector<float> fx(nfaces), fy(nfaces), fz(nfaces);
+	parallel_for(nfaces, [&](int start, int end) {
+		for (int f = start; f < end; f++) {
+			auto &t = triangles[f];
+			auto a = pos[t.y] - pos[t.z];
+			auto b = pos[t.x] - pos[t.z];
+			fx[f] = a.y * b.z - a.z * b.y;
+			fy[f] = a.z * b.x - a.x * b.z;
+			fz[f] = a.x * b.y - a.y * b.x;
+		}
+		if (!weighted) {
+			for (int f = start; f < end; f++) {
+				float l = std::sqrt(fx[f] * fx[f] + fy[f] * fy[f] + fz[f] * fz[f]);
+				float il = l > 0 ? 1 / l : 0;
+				fx[f] *= il;
+				fy[f] *= il;
+				fz[f] *= il;
+			}
+		}
+	});
+
+	// step 2: vertex to face adjacency in CSR format.
+	// offsets[v] .. offsets[v + 1] is the range of faces adjacent to v.
+	std::vector<int> offsets(nverts + 1, 0);
+	std::vector<std::atomic<int>> counts(nverts);
+	parallel_for(nfaces, [&](int start, int end) {
+		for (int f = start; f < end; f++)
+			for (auto vid : triangles[f])
+				counts[vid].fetch_add(1, std::memory_order_relaxed);
+	});
+	for (int v = 0; v < nverts; v++)
+		offsets[v + 1] = offsets[v] + counts[v].load(std::memory_order_relaxed);
+	// reuse counts as per vertex insertion cursors
+	parallel_for(nverts, [&](int start, int end) {
+		for (int v = start; v < end; v++)
+			counts[v].store(offsets[v], std::memory_order_relaxed);
+	});
+	std::vector<int> adjacency(offsets[nverts]);
+	parallel_for(nfaces, [&](int start, int end) {
+		for (int f = start; f < end; f++)
+			for (auto vid : triangles[f])
+				adjacency[counts[vid].fetch_add(1, std::memory_order_relaxed)] = f;
+	});
+
+	// step 3: gather. Each vertex is owned by exactly one thread, so there
+	// is no need to synchronize the accumulation. Face lists are sorted to
+	// make the summation order (and the result) independent from scheduling.
+	std::vector<float> nx(nverts), ny(nverts), nz(nverts);
+	parallel_for(nverts, [&](int start, int end) {
+		for (int v = start; v < end; v++) {
+			auto first = adjacency.begin() + offsets[v];
+			auto last = adjacency.begin() + offsets[v + 1];
+			std::sort(first, last);
+			float sx = 0, sy = 0, sz = 0;
+			for (auto it = first; it != last; ++it) {
+				sx += fx[*it];
+				sy += fy[*it];
+				sz += fz[*it];
+			}
+			nx[v] = sx;
+			ny[v] = sy;
+			nz[v] = sz;
+		}
+		// normalize (vertices without faces keep a zero normal)
+		for (int v = start; v < end; v++) {
+			float l2 = nx[v] * nx[v] + ny[v] * ny[v] + nz[v] * nz[v];
+			float il = l2 > 0 ? 1 / std::sqrt(l2) : 0;
+			nx[v] *= il;
+			ny[v] *= il;
+			nz[v] *= il;
+		}
+		for (int v = start; v < end; v++)
+			norm[v] = { nx[v], ny[v], nz[v] };
+	});
+}
+
+// tessellation levels of the unit shapes
+static const int sphereTessellation = 4;
+static const int circleSteps = 64;
+
+//
+// make_unit_sphere
+//
+void make_unit_sphere(ygl::shape *shp) {
+	ygl::make_uvspherizedcube(shp->quads, shp->pos, shp->norm, shp->texcoord, sphereTessellation, 1);
+}
+
+//
+// make_unit_disk
+// Texture coordinates follow pbrt: u goes with the angle, v from the border to the center.
+//
+void make_unit_disk(ygl::shape *shp, float inner, float phimax) {
+	int nphi = std::max(1, (int)std::ceil(circleSteps * phimax / (2 * ygl::pif)));
+	for (int p = 0; p <= nphi; p++) {
+		float u = (float)p / nphi;
+		float phi = u * phimax;
+		shp->pos.push_back({ std::cos(phi), std::sin(phi), 0 });
+		shp->pos.push_back({ inner * std::cos(phi), inner * std::sin(phi), 0 });
+		shp->texcoord.push_back({ u, 0 });
+		shp->texcoord.push_back({ u, 1 });
+		shp->norm.push_back({ 0, 0, 1 });
+		shp->norm.push_back({ 0, 0, 1 });
+	}
+	for (int p = 0; p < nphi; p++) {
+		int o0 = 2 * p, i0 = 2 * p + 1, o1 = 2 * p + 2, i1 = 2 * p + 3;
+		if (inner > 0)
+			shp->quads.push_back({ i0, o0, o1, i1 });
+		else
+			shp->quads.push_back({ i0, o0, o1, o1 });
+	}
+}
+
+//
+// make_unit_cylinder
+// Texture coordinates follow pbrt: u goes with the angle, v with the height.
+//
+void make_unit_cylinder(ygl::shape *shp, float phimax) {
+	int nphi = std::max(1, (int)std::ceil(circleSteps * phimax / (2 * ygl::pif)));
+	for (int p = 0; p <= nphi; p++) {
+		float u = (float)p / nphi;
+		float phi = u * phimax;
+		ygl::vec3f n = { std::cos(phi), std::sin(phi), 0 };
+		shp->pos.push_back(n);
+		shp->pos.push_back({ n.x, n.y, 1 });
+		shp->texcoord.push_back({ u, 0 });
+		shp->texcoord.push_back({ u, 1 });
+		shp->norm.push_back(n);
+		shp->norm.push_back(n);
+	}
+	for (int p = 0; p < nphi; p++) {
+		int b0 = 2 * p, t0 = 2 * p + 1, b1 = 2 * p + 2, t1 = 2 * p + 3;
+		shp->quads.push_back({ b0, b1, t1, t0 });
+	}
+}
+
+//
+// transform_shape
+// Normals are transformed by the inverse transpose, to stay correct with non
+// uniform scaling, and normalized again.
+//
+void transform_shape(ygl::shape *shp, const ygl::mat4f &xform) {
+	auto nxform = ygl::transpose(ygl::inverse(xform));
+	for (auto &p : shp->pos)
+		p = ygl::transform_point(xform, p);
+	for (auto &n : shp->norm)
+		n = ygl::normalize(ygl::transform_direction(nxform, n));
+}
+
+//
+// quantize
+// Grid cell of a vertex attribute (inv is 1 / cell size), or with 0 the bits of
+// the value itself (with -0 and 0 considered equal).
+//
+static inline int64_t quantize(float x, float inv) {
+	if (inv > 0)
+		return (int64_t)std::floor((double)x * inv);
+	if (x == 0)
+		return 0;
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return bits;
+}
+
+//
+// remap_elements
+// replaces the vertex indices of the elements, removing the ones that become
+// degenerate if drop is true.
+//
+template <typename T>
+static void remap_elements(std::vector<T> &elems, const std::vector<int> &remap, bool drop) {
+	parallel_for((int)elems.size(), [&](int start, int end) {
+		for (int e = start; e < end; e++)
+			for (auto &i : elems[e])
+				i = remap[i];
+	});
+	if (!drop)
+		return;
+	auto last = std::remove_if(elems.begin(), elems.end(), [](const T &e) {
+		for (auto i = ygl::begin(e); i != ygl::end(e); ++i)
+			for (auto j = i + 1; j != ygl::end(e); ++j)
+				if (*i == *j) return true;
+		return false;
+	});
+	elems.erase(last, elems.end());
+}
+
+static void remap_elements(std::vector<int> &elems, const std::vector<int> &remap, bool) {
+	for (auto &i : elems)
+		i = remap[i];
+}
+
+//
+// compact_vertices
+// keeps the values of the vertices with index[v] >= 0, at position index[v].
+//
+template <typename T>
+static void compact_vertices(std::vector<T> &values, const std::vector<int> &index, int count) {
+	if (values.empty())
+		return;
+	std::vector<T> compacted(count);
+	for (int v = 0; v < (int)index.size(); v++)
+		if (index[v] >= 0)
+			compacted[index[v]] = values[v];
+	values.swap(compacted);
+}
+
+//
+// weld_vertices
+// Vertex keys (the quantized attributes) and their hashes are computed in
+// parallel, then vertices are inserted in order in an open addressing table,
+// so that every vertex is merged with the first one with the same key.
+//
+int weld_vertices(ygl::shape *shp, float posTolerance, float attrTolerance) {
+	int nverts = (int)shp->pos.size();
+	if (nverts == 0 || !shp->quads_pos.empty())
+		return 0;
+
+	// attributes making the key: values, components and cell size
+	struct Attribute {
+		const float *values;
+		int dims;
+		float inv;
+	};
+	std::vector<Attribute> attributes{};
+	bool valid = true;
+	auto add = [&](const float *values, size_t size, int dims, float tolerance) {
+		if (size == 0)
+			return;
+		valid = valid && size == (size_t)nverts;
+		attributes.push_back({ values, dims, tolerance > 0 ? 1 / tolerance : 0 });
+	};
+	add(&shp->pos[0].x, shp->pos.size(), 3, posTolerance);
+	add(shp->norm.empty() ? nullptr : &shp->norm[0].x, shp->norm.size(), 3, attrTolerance);
+	add(shp->texcoord.empty() ? nullptr : &shp->texcoord[0].x, shp->texcoord.size(), 2, attrTolerance);
+	add(shp->texcoord1.empty() ? nullptr : &shp->texcoord1[0].x, shp->texcoord1.size(), 2, attrTolerance);
+	add(shp->color.empty() ? nullptr : &shp->color[0].x, shp->color.size(), 4, attrTolerance);
+	add(shp->radius.empty() ? nullptr : shp->radius.data(), shp->radius.size(), 1, attrTolerance);
+	add(shp->tangsp.empty() ? nullptr : &shp->tangsp[0].x, shp->tangsp.size(), 4, attrTolerance);
+	if (!valid)
+		return 0;
+	int ncomp = 0;
+	for (auto &a : attributes)
+		ncomp += a.dims;
+
+	std::vector<int64_t> keys((size_t)nverts * ncomp);
+	std::vector<uint64_t> hashes(nverts);
+	parallel_for(nverts, [&](int start, int end) {
+		for (int v = start; v < end; v++) {
+			auto key = &keys[(size_t)v * ncomp];
+			for (auto &a : attributes)
+				for (int c = 0; c < a.dims; c++)
+					*key++ = quantize(a.values[(size_t)v * a.dims + c], a.inv);
+			hashes[v] = hash_bytes(&keys[(size_t)v * ncomp], ncomp * sizeof(int64_t));
+		}
+	});
+
+	// first vertex with the same key
+	size_t tableSize = 1;
+	while (tableSize < (size_t)nverts * 2)
+		tableSize *= 2;
+	std::vector<int> table(tableSize, -1);
+	std::vector<int> first(nverts);
+	for (int v = 0; v < nverts; v++) {
+		auto slot = hashes[v] & (tableSize - 1);
+		while (table[slot] >= 0 && (hashes[table[slot]] != hashes[v] ||
+			memcmp(&keys[(size_t)table[slot] * ncomp], &keys[(size_t)v * ncomp], ncomp * sizeof(int64_t))))
+			slot = (slot + 1) & (tableSize - 1);
+		if (table[slot] < 0)
+			table[slot] = v;
+		first[v] = table[slot];
+	}
+	std::vector<int64_t>().swap(keys);
+	std::vector<uint64_t>().swap(hashes);
+	std::vector<int>().swap(table);
+
+	remap_elements(shp->points, first, false);
+	remap_elements(shp->lines, first, true);
+	remap_elements(shp->triangles, first, true);
+	remap_elements(shp->quads, first, false);
+	remap_elements(shp->beziers, first, false);
+
+	// new indices of the used vertices, in their order
+	std::vector<int> index(nverts, -1);
+	auto mark = [&](int v) { index[v] = 0; };
+	for (auto i : shp->points) mark(i);
+	for (auto &e : shp->lines) for (auto i : e) mark(i);
+	for (auto &e : shp->triangles) for (auto i : e) mark(i);
+	for (auto &e : shp->quads) for (auto i : e) mark(i);
+	for (auto &e : shp->beziers) for (auto i : e) mark(i);
+	int count = 0;
+	for (int v = 0; v < nverts; v++)
+		if (index[v] == 0) index[v] = count++;
+	if (count == nverts)
+		return 0;
+
+	remap_elements(shp->points, index, false);
+	remap_elements(shp->lines, index, false);
+	remap_elements(shp->triangles, index, false);
+	remap_elements(shp->quads, index, false);
+	remap_elements(shp->beziers, index, false);
+	compact_vertices(shp->pos, index, count);
+	compact_vertices(shp->norm, index, count);
+	compact_vertices(shp->texcoord, index, count);
+	compact_vertices(shp->texcoord1, index, count);
+	compact_vertices(shp->color, index, count);
+	compact_vertices(shp->radius, index, count);
+	compact_vertices(shp->tangsp, index, count);
+	return nverts - count;
+}
+
+//
+// hash_array
+//
+template <typename T>
+static uint64_t hash_array(uint64_t h, const std::vector<T> &v) {
+	uint64_t size = v.size();
+	h = hash_bytes(&size, sizeof(size), h);
+	return hash_bytes(v.data(), v.size() * sizeof(T), h);
+}
+
+//
+// same_bytes
+//
+template <typename T>
+static bool same_bytes(const std::vector<T> &a, const std::vector<T> &b) {
+	return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+//
+// hash_shape
+// hash of the geometry and material of a shape (the name is not considered).
+//
+static uint64_t hash_shape(const ygl::shape *shp) {
+	auto mat = shp->mat;
+	uint64_t h = hash_bytes(&mat, sizeof(mat));
+	h = hash_array(h, shp->points);
+	h = hash_array(h, shp->lines);
+	h = hash_array(h, shp->triangles);
+	h = hash_array(h, shp->quads);
+	h = hash_array(h, shp->quads_pos);
+	h = hash_array(h, shp->quads_norm);
+	h = hash_array(h, shp->quads_texcoord);
+	h = hash_array(h, shp->beziers);
+	h = hash_array(h, shp->pos);
+	h = hash_array(h, shp->norm);
+	h = hash_array(h, shp->texcoord);
+	h = hash_array(h, shp->texcoord1);
+	h = hash_array(h, shp->color);
+	h = hash_array(h, shp->radius);
+	h = hash_array(h, shp->tangsp);
+	return h;
+}
+
+//
+// same_shape
+//
+static bool same_shape(const ygl::shape *a, const ygl::shape *b) {
+	return a->mat == b->mat && a->subdivision == b->subdivision &&
+		a->catmullclark == b->catmullclark &&
+		same_bytes(a->points, b->points) && same_bytes(a->lines, b->lines) &&
+		same_bytes(a->triangles, b->triangles) && same_bytes(a->quads, b->quads) &&
+		same_bytes(a->quads_pos, b->quads_pos) && same_bytes(a->quads_norm, b->quads_norm) &&
+		same_bytes(a->quads_texcoord, b->quads_texcoord) && same_bytes(a->beziers, b->beziers) &&
+		same_bytes(a->pos, b->pos) && same_bytes(a->norm, b->norm) &&
+		same_bytes(a->texcoord, b->texcoord) && same_bytes(a->texcoord1, b->texcoord1) &&
+		same_bytes(a->color, b->color) && same_bytes(a->radius, b->radius) &&
+		same_bytes(a->tangsp, b->tangsp);
+}
+
+//
+// same_shape_group
+//
+static bool same_shape_group(const ygl::shape_group *a, const ygl::shape_group *b) {
+	if (a->shapes.size() != b->shapes.size())
+		return false;
+	for (size_t i = 0; i < a->shapes.size(); i++)
+		if (!same_shape(a->shapes[i], b->shapes[i]))
+			return false;
+	return true;
+}
+
+//
+// merge_duplicate_shapes
+// Hashes are computed in parallel, candidates with the same hash are then
+// compared byte by byte.
+//
+int merge_duplicate_shapes(ygl::scene *scn) {
+	int nsgs = (int)scn->shapes.size();
+	std::vector<uint64_t> hashes(nsgs);
+	parallel_for(nsgs, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			uint64_t h = hash_bytes(nullptr, 0);
+			for (auto shp : scn->shapes[i]->shapes) {
+				auto hs = hash_shape(shp);
+				h = hash_bytes(&hs, sizeof(hs), h);
+			}
+			hashes[i] = h;
+		}
+	}, 16);
+
+	// map each duplicate to the first equal shape group
+	std::unordered_multimap<uint64_t, ygl::shape_group *> unique{};
+	std::unordered_map<ygl::shape_group *, ygl::shape_group *> replacement{};
+	for (int i = 0; i < nsgs; i++) {
+		auto sg = scn->shapes[i];
+		auto range = unique.equal_range(hashes[i]);
+		bool found = false;
+		for (auto it = range.first; it != range.second && !found; ++it) {
+			if (same_shape_group(it->second, sg)) {
+				replacement[sg] = it->second;
+				found = true;
+			}
+		}
+		if (!found)
+			unique.insert(std::make_pair(hashes[i], sg));
+	}
+	if (replacement.empty())
+		return 0;
+
+	for (auto inst : scn->instances) {
+		auto it = replacement.find(inst->shp);
+		if (it != replacement.end())
+			inst->shp = it->second;
+	}
+	auto end = std::remove_if(scn->shapes.begin(), scn->shapes.end(),
+		[&replacement](ygl::shape_group *sg) { return replacement.count(sg) > 0; });
+	scn->shapes.erase(end, scn->shapes.end());
+	for (auto &kv : replacement)
+		delete kv.first;
+	return (int)replacement.size();
+}
+
+//
+// append_elements
+// append src to dst, adding offset to every index.
+//
+template <typename T>
+static void append_elements(std::vector<T> &dst, const std::vector<T> &src, int offset) {
+	for (auto e : src) {
+		for (auto &i : e)
+			i += offset;
+		dst.push_back(e);
+	}
+}
+
+//
+// free_shape_data
+//
+static void free_shape_data(ygl::shape *shp) {
+	std::vector<ygl::vec3i>().swap(shp->triangles);
+	std::vector<ygl::vec4i>().swap(shp->quads);
+	std::vector<ygl::vec3f>().swap(shp->pos);
+	std::vector<ygl::vec3f>().swap(shp->norm);
+	std::vector<ygl::vec2f>().swap(shp->texcoord);
+	std::vector<ygl::vec4f>().swap(shp->color);
+}
+
+//
+// batch_shapes
+// Shapes are grouped by material, element type (triangles or quads) and vertex
+// attributes, so that they can be concatenated. Every group is then split in
+// batches, in scene order, and batches are built in parallel across groups.
+// Source vertex data is released as soon as it is copied in its batch.
+//
+int batch_shapes(ygl::scene *scn, int maxVertices) {
+	struct BatchItem {
+		ygl::shape *shp;
+		ygl::mat4f xform;
+	};
+	struct BatchGroup {
+		std::vector<BatchItem> items;
+		std::vector<ygl::shape_group *> batches;
+	};
+
+	// number of instances of every shape group
+	std::unordered_map<ygl::shape_group *, int> uses{};
+	for (auto inst : scn->instances)
+		uses[inst->shp]++;
+
+	auto batchable = [](const ygl::shape *shp) {
+		return shp->points.empty() && shp->lines.empty() && shp->beziers.empty() &&
+			shp->quads_pos.empty() && shp->radius.empty() && shp->texcoord1.empty() &&
+			shp->tangsp.empty() && !shp->subdivision &&
+			(shp->triangles.empty() != shp->quads.empty());
+	};
+
+	std::vector<BatchGroup> groups{};
+	std::map<std::pair<ygl::material *, int>, int> groupIndex{};
+	std::unordered_map<ygl::instance *, bool> batchedInstances{};
+	for (auto inst : scn->instances) {
+		auto sg = inst->shp;
+		if (!sg || uses[sg] != 1)
+			continue;
+		bool all = true;
+		for (auto shp : sg->shapes)
+			all = all && batchable(shp);
+		if (!all)
+			continue;
+		batchedInstances[inst] = true;
+		auto xform = ygl::frame_to_mat(inst->frame);
+		for (auto shp : sg->shapes) {
+			int kind = (shp->triangles.empty() ? 1 : 0) | (shp->norm.empty() ? 0 : 2) |
+				(shp->texcoord.empty() ? 0 : 4) | (shp->color.empty() ? 0 : 8);
+			auto key = std::make_pair(shp->mat, kind);
+			auto it = groupIndex.find(key);
+			if (it == groupIndex.end()) {
+				it = groupIndex.insert(std::make_pair(key, (int)groups.size())).first;
+				groups.push_back(BatchGroup());
+			}
+			groups[it->second].items.push_back({ shp, xform });
+		}
+	}
+
+	parallel_for((int)groups.size(), [&](int start, int end) {
+		for (int g = start; g < end; g++) {
+			auto &items = groups[g].items;
+			int first = 0;
+			while (first < (int)items.size()) {
+				// fill a batch with as many shapes as possible
+				int last = first;
+				int nverts = 0;
+				do {
+					nverts += (int)items[last].shp->pos.size();
+					last++;
+				} while (last < (int)items.size() &&
+					nverts + (int)items[last].shp->pos.size() <= maxVertices);
+
+				auto batch = new ygl::shape();
+				batch->mat = items[first].shp->mat;
+				batch->pos.reserve(nverts);
+				for (int i = first; i < last; i++) {
+					auto src = items[i].shp;
+					int offset = (int)batch->pos.size();
+					transform_shape(src, items[i].xform);
+					batch->pos.insert(batch->pos.end(), src->pos.begin(), src->pos.end());
+					batch->norm.insert(batch->norm.end(), src->norm.begin(), src->norm.end());
+					batch->texcoord.insert(batch->texcoord.end(), src->texcoord.begin(), src->texcoord.end());
+					batch->color.insert(batch->color.end(), src->color.begin(), src->color.end());
+					append_elements(batch->triangles, src->triangles, offset);
+					append_elements(batch->quads, src->quads, offset);
+					free_shape_data(src);
+				}
+				auto sg = new ygl::shape_group();
+				sg->shapes.push_back(batch);
+				groups[g].batches.push_back(sg);
+				first = last;
+			}
+		}
+	}, 1);
+
+	// replace the batched shape groups and instances
+	std::vector<ygl::instance *> instances{};
+	std::vector<ygl::shape_group *> removed{};
+	for (auto inst : scn->instances) {
+		if (batchedInstances.count(inst)) {
+			removed.push_back(inst->shp);
+			delete inst;
+		}
+		else
+			instances.push_back(inst);
+	}
+	scn->instances = instances;
+	std::unordered_map<ygl::shape_group *, bool> isRemoved{};
+	for (auto sg : removed)
+		isRemoved[sg] = true;
+	auto last = std::remove_if(scn->shapes.begin(), scn->shapes.end(),
+		[&isRemoved](ygl::shape_group *sg) { return isRemoved.count(sg) > 0; });
+	scn->shapes.erase(last, scn->shapes.end());
+	for (auto sg : removed)
+		delete sg;
+
+	int count = 0;
+	for (auto &group : groups) {
+		for (auto sg : group.batches) {
+			auto id = std::to_string(count++);
+			sg->name = "sgb_" + id;
+			sg->shapes[0]->name = "sb_" + id;
+			scn->shapes.push_back(sg);
+			auto inst = new ygl::instance();
+			inst->name = "ib_" + id;
+			inst->shp = sg;
+			scn->instances.push_back(inst);
+		}
+	}
+	return count;
+}
@@ -0,0 +1,77 @@
+#ifndef __GEOMETRY__
+#define __GEOMETRY__
+#include <vector>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
+#include <map>
+#include "../yocto/yocto_gl.h"
+#include "utils.h"
+
+//
+// compute_vertex_normals
+// Computes per vertex normals of a triangle mesh, following pbrt winding.
+// Face normals are computed in parallel, then every vertex gathers the normals
+// of its adjacent faces through a vertex-to-face adjacency (CSR) so that
+// no two threads write the same vertex.
+//
+void compute_vertex_normals(const std::vector<ygl::vec3i>& triangles,
+	const std::vector<ygl::vec3f>& pos, std::vector<ygl::vec3f>& norm, bool weighted = true);
+
+//
+// make_unit_sphere
+// Tessellates a sphere of radius 1 centered at the origin.
+//
+void make_unit_sphere(ygl::shape *shp);
+
+//
+// make_unit_disk
+// Tessellates a disk of radius 1 on the z = 0 plane, facing +z, with an optional
+// hole of radius "inner" (in [0, 1)) and covering "phimax" radians.
+//
+void make_unit_disk(ygl::shape *shp, float inner = 0, float phimax = 2 * ygl::pif);
+
+//
+// make_unit_cylinder
+// Tessellates an open cylinder of radius 1 around the z axis, from z = 0 to z = 1,
+// covering "phimax" radians.
+//
+void make_unit_cylinder(ygl::shape *shp, float phimax = 2 * ygl::pif);
+
+//
+// transform_shape
+// Bakes a transformation in the vertices (positions and normals) of a shape.
+//
+void transform_shape(ygl::shape *shp, const ygl::mat4f &xform);
+
+//
+// weld_vertices
+// Merges the vertices of a shape whose attributes all fall in the same cells of
+// a grid: of size posTolerance for positions and attrTolerance for the others
+// (0 merges only identical vertices). Elements are rebuilt on the remaining
+// vertices, triangles and lines that collapse are dropped, and vertices not
+// used by any element are removed. Shapes with face-varying quads are left
+// untouched. Returns the number of vertices removed.
+//
+int weld_vertices(ygl::shape *shp, float posTolerance, float attrTolerance = 1e-4f);
+
+//
+// merge_duplicate_shapes
+// Finds shape groups with byte-identical geometry and the same materials, keeps
+// only the first one of them and makes all the instances point to it.
+// Returns the number of shape groups removed from the scene.
+//
+int merge_duplicate_shapes(ygl::scene *scn);
+
+//
+// batch_shapes
+// Static batching: shapes used by a single instance are transformed to world
+// space and concatenated, by material, into meshes of at most maxVertices
+// vertices. Instanced shape groups are left untouched.
+// Returns the number of batched meshes created.
+//
+int batch_shapes(ygl::scene *scn, int maxVertices);
+
+#endif
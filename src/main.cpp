@@ -1,31 +1,131 @@
 
 #include "PBRTParser.h"
+#include "OBJWriter.h"
+#include "BinaryScene.h"
+#include "GLTFWriter.h"
+#include "TextureAtlas.h"
 #include <fstream>
 
 int main(int argc, char** argv){
 	
-	if (argc < 3)
-	{
-		printf("Usage: command <input_scene_file> <output_scene_file>\n");
+	auto cmd = ygl::make_parser(argc, argv, "parse", "Converts a pbrt (v3) scene to obj.");
+	auto batchSize = ygl::parse_opt<int>(cmd, "--batch", "-b",
+		"merge non instanced shapes by material, up to the given number of vertices (0 to disable)", 0);
+	auto digits = ygl::parse_opt<int>(cmd, "--digits", "-d",
+		"significant digits of the numbers in the obj (0 for the shortest exact representation)", 0);
+	auto weld = ygl::parse_opt<float>(cmd, "--weld", "-w",
+		"merge the mesh vertices closer than the given distance (0 for identical ones, negative to disable)", -1);
+	auto maxTextureSize = ygl::parse_opt<int>(cmd, "--max-texture-size", "-t",
+		"halve the image textures until their width and height are at most the given size (0 to disable)", 0);
+	auto atlasSize = ygl::parse_opt<int>(cmd, "--atlas", "-a",
+		"pack the image textures of at most the given width and height, that do not wrap, in atlases (0 to disable)", 0);
+	auto fastPNG = ygl::parse_flag(cmd, "--fast-png", "",
+		"faster png compression of the textures, with bigger files", false);
+	auto linkTextures = ygl::parse_flag(cmd, "--link-textures", "",
+		"hard link the image files of the textures instead of copying them", false);
+	auto stream = ygl::parse_flag(cmd, "--stream", "-s",
+		"write the shapes and the textures while parsing, freeing their memory", false);
+	auto inputFile = ygl::parse_arg<std::string>(cmd, "input_scene_file", "pbrt (or " BINARY_SCENE_EXTENSION ") scene to convert");
+	auto outputFile = ygl::parse_arg<std::string>(cmd, "output_scene_file", "obj, gltf, glb (or " BINARY_SCENE_EXTENSION ") file to write");
+	if (ygl::should_exit(cmd)) {
+		printf("%s", ygl::get_usage(cmd).c_str());
 		exit(1);
 	}
-	auto parser = PBRTParser(argv[1]);
+
+	auto ext = ygl::path_extension(outputFile);
+	// binary scenes are loaded back (see load_binary_scene) instead of parsed
+	auto binaryInput = ygl::path_extension(inputFile) == BINARY_SCENE_EXTENSION;
+	if (stream && (ext != ".obj" || batchSize > 0 || atlasSize > 0 || binaryInput)) {
+		std::cout << "Streaming is supported only for pbrt input and obj output without batching or atlases, ignoring --stream.\n";
+		stream = false;
+	}
+	auto so = OBJSaveOptions();
+	so.digits = digits;
+	so.skipMissing = false;
+	so.fastPNG = fastPNG;
+	so.linkTextures = linkTextures;
+
+	// textures of a binary scene are loaded with their pixels, they have no sources
+	auto noSources = TextureSources();
+	auto noImages = TextureImages();
+	std::unique_ptr<PBRTParser> parser;
+	if (!binaryInput)
+		parser.reset(new PBRTParser(inputFile));
+	auto &sources = (parser) ? parser->texture_sources() : noSources;
+	auto &images = (parser) ? parser->texture_images() : noImages;
+	so.textureSources = &sources;
+	so.textureImages = &images;
+	std::unique_ptr<OBJStreamWriter> sink;
 	ygl::scene *scn;
 	try {
-		scn = parser.parse();
+		if (binaryInput) {
+			scn = load_binary_scene(inputFile);
+		}
+		else {
+			parser->set_weld_tolerance(weld);
+			parser->set_max_texture_size(maxTextureSize);
+			// duplicates are merged after batching, else the shapes repeated in the
+			// scene would look instanced and would not be batched
+			parser->set_merge_duplicates(batchSize <= 0);
+			if (stream) {
+				sink.reset(new OBJStreamWriter(outputFile, so));
+				parser->set_shape_sink(sink.get());
+			}
+			scn = parser->parse();
+		}
 	}
-	catch (PBRTException ex) {
+	catch (const PBRTException &ex) {
 		std::cout << ex.what() << std::endl;
 		return 1;
 	}
+	catch (const std::exception &ex) {
+		std::cout << ex.what() << "\n";
+		return 1;
+	}
+
+	if (atlasSize > 0) {
+		auto ao = AtlasOptions();
+		ao.maxSize = atlasSize;
+		auto n = pack_texture_atlases(scn, ao, &sources, &images);
+		std::cout << n << " textures packed in atlases.\n";
+	}
+
+	if (batchSize > 0) {
+		auto n = batch_shapes(scn, batchSize);
+		std::cout << "Non instanced shapes merged into " << n << " batches.\n";
+		merge_duplicate_shapes(scn);
+	}
 
 	try {
-		std::cout << "Conversion ended. Saving obj to file..\n";
-		auto so = ygl::save_options();
-		so.skip_missing = false;
-		ygl::save_scene(argv[2], scn, so);
+		std::cout << "Conversion ended. Saving scene to file..\n";
+		if (sink) {
+			sink->finish(scn);
+		}
+		else if (ext == ".obj") {
+			write_obj_scene(outputFile, scn, so);
+		}
+		else if (ext == BINARY_SCENE_EXTENSION) {
+			write_binary_scene(outputFile, scn, true, false, &sources, &images);
+		}
+		else if (ext == ".gltf" || ext == ".glb") {
+			auto so = GLTFSaveOptions();
+			so.binary = ext == ".glb";
+			so.skipMissing = false;
+			so.fastPNG = fastPNG;
+			so.textureSources = &sources;
+			so.linkTextures = linkTextures;
+			so.textureImages = &images;
+			write_gltf_scene(outputFile, scn, so);
+		}
+		else {
+			// yocto saves the pixels of the textures
+			expand_textures(scn, images);
+			auto so = ygl::save_options();
+			so.skip_missing = false;
+			ygl::save_scene(outputFile, scn, so);
+		}
 	}
-	catch (std::exception ex) {
+	catch (const std::exception &ex) {
 		std::cout << ex.what() << "\n";
 	}
 	
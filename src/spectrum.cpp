@@ -23,6 +23,15 @@ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include "spectrum.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SPECTRUM_SSE2
+#endif
 
 //
 // lerp
@@ -30,70 +39,140 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 inline float lerp(float t, float v1, float v2) { return (1 - t) * v1 + t * v2; }
 
 //
-// find_interval
+// is_spectrum_sorted
 //
-template <typename Predicate>
-int find_interval(int size, const Predicate &pred) {
-	int first = 0, len = size;
-	while (len > 0) {
-		int half = len >> 1, middle = first + half;
-		// Bisect range based on value of _pred_ at _middle_
-		if (pred(middle)) {
-			first = middle + 1;
-			len -= half + 1;
-		}
-		else
-			len = half;
-	}
-	return ygl::clamp(first - 1, 0, size - 2);
+bool is_spectrum_sorted(const std::vector<ygl::vec2f> &samples) {
+	for (size_t i = 0; i + 1 < samples.size(); ++i)
+		if (samples[i].x > samples[i + 1].x) 
+			return false;
+	return true;
 }
 
 //
-// is_spectrum_sorted
+// cie_weights
+// CIE X, Y, Z at the CIE wavelengths (in x, y, z, w is unused), with the
+// normalization of the integral already applied. Computed at the first use.
 //
-bool is_spectrum_sorted(std::vector<ygl::vec2f> &samples) {
-	for (int i = 0; i < samples.size() - 1; ++i)
-		if (samples[i].x > samples[i + 1].x) 
+static const std::vector<ygl::vec4f> &cie_weights() {
+	static const std::vector<ygl::vec4f> weights = [] {
+		float scale = float(CIE_lambda[nCIESamples - 1] - CIE_lambda[0]) /
+			float(CIE_Y_integral * nCIESamples);
+		std::vector<ygl::vec4f> w(nCIESamples);
+		for (int i = 0; i < nCIESamples; ++i)
+			w[i] = { CIE_X[i] * scale, CIE_Y[i] * scale, CIE_Z[i] * scale, 0 };
+		return w;
+	}();
+	return weights;
+}
+
+//
+// weighted_sum
+// Sum of values[i * stride] * weights[i], for i < n.
+//
+static ygl::vec3f weighted_sum(const float *values, int stride, const ygl::vec4f *weights, int n) {
+	ygl::vec4f sum = { 0, 0, 0, 0 };
+	int i = 0;
+#ifdef SPECTRUM_SSE2
+	auto acc = _mm_setzero_ps();
+	for (; i < n; i++)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(values[i * stride]), _mm_loadu_ps(&weights[i].x)));
+	_mm_storeu_ps(&sum.x, acc);
+#endif
+	for (; i < n; i++)
+		sum += values[i * stride] * weights[i];
+	return { sum.x, sum.y, sum.z };
+}
+
+//
+// regular_grid
+// True if the wavelengths of the (sorted) samples are lambda0 + i * step.
+//
+static bool regular_grid(const std::vector<ygl::vec2f> &samples, float &step) {
+	int n = (int)samples.size();
+	if (n < 2)
+		return false;
+	step = (samples[n - 1].x - samples[0].x) / (n - 1);
+	if (!(step > 0))
+		return false;
+	for (int i = 1; i < n - 1; ++i)
+		if (std::abs(samples[i].x - (samples[0].x + i * step)) > 1e-4f * step)
 			return false;
 	return true;
 }
 
 //
-// interpolate_spectrum_samples
+// grid_weights
+// Weights of the samples of the spectra with n wavelengths lambda0 + i * step:
+// the CIE weights of the wavelengths around each sample, multiplied by its
+// share in their linear interpolation. Computed once for every grid.
 //
-float interpolate_spectrum_samples(std::vector<ygl::vec2f> &samples, float l) {
-	int n = samples.size();
-	if (l <= samples[0].x) return samples[0].y;
-	if (l >= samples[n - 1].x) return samples[n - 1].y;
-	int offset = find_interval(n, [&](int index) { return samples[index].x <= l; });
-	float t = (l - samples[offset].x) / (samples[offset + 1].x - samples[offset].x);
-	return lerp(t, samples[offset].y, samples[offset + 1].y);
+static std::shared_ptr<const std::vector<ygl::vec4f>> grid_weights(float lambda0, float step, int n) {
+	static std::map<std::tuple<float, float, int>, std::shared_ptr<const std::vector<ygl::vec4f>>> grids;
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+	auto &weights = grids[std::make_tuple(lambda0, step, n)];
+	if (weights)
+		return weights;
+
+	auto &cie = cie_weights();
+	auto w = std::make_shared<std::vector<ygl::vec4f>>(n, ygl::vec4f{ 0, 0, 0, 0 });
+	for (int i = 0; i < nCIESamples; ++i) {
+		float t = (CIE_lambda[i] - lambda0) / step;
+		if (t <= 0)
+			(*w)[0] += cie[i];
+		else if (t >= n - 1)
+			(*w)[n - 1] += cie[i];
+		else {
+			int j = ygl::clamp((int)t, 0, n - 2);
+			(*w)[j] += (1 - (t - j)) * cie[i];
+			(*w)[j + 1] += (t - j) * cie[i];
+		}
+	}
+	weights = w;
+	return weights;
 }
 
 //
 // spectrum_to_rgb
 // Convert sampled spectrum to rgb
 //
-ygl::vec3f spectrum_to_rgb(std::vector<ygl::vec2f> &samples) {
+ygl::vec3f spectrum_to_rgb(const std::vector<ygl::vec2f> &samples) {
+	if (samples.empty())
+		return { 0, 0, 0 };
 	if (!is_spectrum_sorted(samples)) {
-		std::sort(samples.begin(), samples.end(),
+		auto sorted = samples;
+		std::sort(sorted.begin(), sorted.end(),
 			[](const ygl::vec2f & a, const ygl::vec2f& b) -> bool {
 			return a.x < b.x;
 		});
-	}	
-	ygl::vec3f xyz = { 0, 0, 0 };
+		return spectrum_to_rgb(sorted);
+	}
+	int n = (int)samples.size();
+
+	// samples at regular wavelengths: one weight per sample
+	float step;
+	if (regular_grid(samples, step)) {
+		auto weights = grid_weights(samples[0].x, step, n);
+		return ygl::xyz_to_rgb(weighted_sum(&samples[0].y, 2, weights->data(), n));
+	}
+
+	// others: interpolated at the CIE wavelengths, walking both in order
+	float values[nCIESamples];
+	int j = 0;
 	for (int i = 0; i < nCIESamples; ++i) {
-		float val = interpolate_spectrum_samples(samples, CIE_lambda[i]);
-		xyz.x += val * CIE_X[i];
-		xyz.y += val * CIE_Y[i];
-		xyz.z += val * CIE_Z[i];
+		float l = CIE_lambda[i];
+		if (l <= samples[0].x)
+			values[i] = samples[0].y;
+		else if (l >= samples[n - 1].x)
+			values[i] = samples[n - 1].y;
+		else {
+			while (j < n - 2 && samples[j + 1].x <= l)
+				j++;
+			float t = (l - samples[j].x) / (samples[j + 1].x - samples[j].x);
+			values[i] = lerp(t, samples[j].y, samples[j + 1].y);
+		}
 	}
-	float scale = float(CIE_lambda[nCIESamples - 1] - CIE_lambda[0]) /
-		float(CIE_Y_integral * nCIESamples);
-	xyz[0] *= scale;
-	xyz[1] *= scale;
-	xyz[2] *= scale;
-	return ygl::xyz_to_rgb(xyz);
+	return ygl::xyz_to_rgb(weighted_sum(values, 1, cie_weights().data(), nCIESamples));
 }
 
 //
@@ -117,6 +196,58 @@ bool load_spectrum_from_file(std::string filename, std::vector<ygl::vec2f> &samp
 	return true;
 }
 
+// rgb of the eta and k spectra of the metals measured in the spd files
+// distributed with pbrt, named as in pbrt-v4
+static const std::unordered_map<std::string, ygl::vec3f> namedSpectra = {
+	{ "metal-Ag-eta", { 0.155265f, 0.116723f, 0.138342f } },
+	{ "metal-Ag-k", { 4.82835f, 3.12225f, 2.14696f } },
+	{ "metal-Al-eta", { 1.65746f, 0.880369f, 0.521229f } },
+	{ "metal-Al-k", { 9.22387f, 6.26952f, 4.837f } },
+	{ "metal-Au-eta", { 0.143119f, 0.374957f, 1.44248f } },
+	{ "metal-Au-k", { 3.98316f, 2.38572f, 1.60322f } },
+	{ "metal-Cu-eta", { 0.200438f, 0.924033f, 1.10221f } },
+	{ "metal-Cu-k", { 3.91295f, 2.45285f, 2.14219f } },
+};
+
+//
+// named_spectrum_to_rgb
+//
+bool named_spectrum_to_rgb(const std::string &name, ygl::vec3f &rgb) {
+	auto it = namedSpectra.find(name);
+	if (it == namedSpectra.end())
+		return false;
+	rgb = it->second;
+	return true;
+}
+
+//
+// spectrum_file_to_rgb
+//
+bool spectrum_file_to_rgb(const std::string &filename, ygl::vec3f &rgb) {
+	static std::unordered_map<std::string, ygl::vec3f> converted;
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = converted.find(filename);
+	if (it != converted.end()) {
+		rgb = it->second;
+		return true;
+	}
+
+	std::vector<ygl::vec2f> samples;
+	if (load_spectrum_from_file(filename, samples)) {
+		rgb = spectrum_to_rgb(samples);
+	}
+	else {
+		// missing <metal>.<eta|k>.spd file: the built-in spectrum
+		auto parts = ygl::split(ygl::path_filename(filename), '.');
+		if (parts.size() != 3 || parts[2] != "spd" ||
+			!named_spectrum_to_rgb("metal-" + parts[0] + "-" + parts[1], rgb))
+			return false;
+	}
+	converted[filename] = rgb;
+	return true;
+}
+
 //
 // blackbody
 //
@@ -149,16 +280,54 @@ void blackbody_normalized(const float *lambda, int n, float T, float *Le) {
 	for (int i = 0; i < n; ++i) Le[i] /= maxL;
 }
 
+//
+// blackbody_to_rgb_exact
+//
+ygl::vec3f blackbody_to_rgb_exact(float T, float scale) {
+	float v[nCIESamples];
+	blackbody_normalized(CIE_lambda, nCIESamples, T, v);
+	return scale * ygl::xyz_to_rgb(weighted_sum(v, 1, cie_weights().data(), nCIESamples));
+}
+
+// temperatures in the blackbody table, and its size
+static const float blackbodyMinT = 500, blackbodyMaxT = 50000;
+static const int blackbodyTableSize = 2048;
+
+// position of T in the blackbody table: 1 / sqrt(T), spaced evenly, puts more
+// entries at low temperatures, where the color changes faster
+static float blackbody_table_position(float T) {
+	float u0 = 1 / std::sqrt(blackbodyMinT), u1 = 1 / std::sqrt(blackbodyMaxT);
+	return (u0 - 1 / std::sqrt(T)) / (u0 - u1) * (blackbodyTableSize - 1);
+}
+
+//
+// blackbody_table
+// Rgb of the normalized blackbody at temperatures from blackbodyMinT to
+// blackbodyMaxT, spaced evenly in 1 / sqrt(T). Computed at the first use.
+//
+static const std::vector<ygl::vec3f> &blackbody_table() {
+	static const std::vector<ygl::vec3f> table = [] {
+		std::vector<ygl::vec3f> rgb(blackbodyTableSize);
+		float u0 = 1 / std::sqrt(blackbodyMinT), u1 = 1 / std::sqrt(blackbodyMaxT);
+		for (int i = 0; i < blackbodyTableSize; i++) {
+			float u = u0 + (u1 - u0) * i / (blackbodyTableSize - 1);
+			rgb[i] = blackbody_to_rgb_exact(1 / (u * u), 1);
+		}
+		return rgb;
+	}();
+	return table;
+}
+
 //
 // blackbody_to_rgb
 //
 ygl::vec3f blackbody_to_rgb(float T, float scale) {
-	std::unique_ptr<float[]> v(new float[nCIESamples]);
-	blackbody_normalized(CIE_lambda, nCIESamples, T, v.get());
-	std::vector<ygl::vec2f> samples;
-	for (int i = 0; i < nCIESamples; i++)
-		samples.push_back({ CIE_lambda[i], v[i] });
-	return  scale * spectrum_to_rgb(samples);
+	if (!(T >= blackbodyMinT && T <= blackbodyMaxT))
+		return blackbody_to_rgb_exact(T, scale);
+	auto &table = blackbody_table();
+	float t = blackbody_table_position(T);
+	int i = ygl::clamp((int)t, 0, blackbodyTableSize - 2);
+	return scale * ygl::lerp(table[i], table[i + 1], t - i);
 }
 
 const float CIE_X[nCIESamples] = {
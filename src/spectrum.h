@@ -43,17 +43,50 @@ static const float CIE_Y_integral = 106.856895;
 
 //
 // spectrum_to_rgb
-// Convert sampled spectrum to rgb
+// Convert sampled spectrum to rgb. Samples (lambda, value) can be in any order,
+// the spectrum is linearly interpolated between them and constant outside.
+// Samples at regular wavelengths are converted with a weight per sample,
+// computed once for every set of wavelengths, others with a single sweep of
+// the samples and the CIE wavelengths.
 //
-ygl::vec3f spectrum_to_rgb(std::vector<ygl::vec2f> &samples);
+ygl::vec3f spectrum_to_rgb(const std::vector<ygl::vec2f> &samples);
 
 //
 // load_spectrum_from_file
 //
 bool load_spectrum_from_file(std::string filename, std::vector<ygl::vec2f> &samples);
 
+//
+// spectrum_file_to_rgb
+// Rgb of the spectrum in a file, cached by path for the whole process: every
+// file is read and converted once. A missing <metal>.<eta|k>.spd file is
+// replaced by the built-in spectrum of the metal (see named_spectrum_to_rgb).
+// Returns false if the file cannot be read.
+//
+bool spectrum_file_to_rgb(const std::string &filename, ygl::vec3f &rgb);
+
+//
+// named_spectrum_to_rgb
+// Rgb of the built-in spectra, the eta and k of the metals measured by pbrt,
+// named as in pbrt-v4: metal-Ag-eta, metal-Ag-k, metal-Al-eta, metal-Al-k,
+// metal-Au-eta, metal-Au-k, metal-Cu-eta and metal-Cu-k. Returns false for
+// other names.
+//
+bool named_spectrum_to_rgb(const std::string &name, ygl::vec3f &rgb);
+
 //
 // blackbody_to_rgb
+// Rgb of the blackbody at temperature T (in Kelvin), normalized to a peak of 1
+// and multiplied by scale. Between 500K and 50000K it is interpolated in a table
+// computed at the first use (at temperatures spaced evenly in 1 / sqrt(T)),
+// within 0.015% of the peak channel of blackbody_to_rgb_exact; elsewhere it is
+// computed with blackbody_to_rgb_exact.
 //
 ygl::vec3f blackbody_to_rgb(float T, float scale);
+
+//
+// blackbody_to_rgb_exact
+// Same as blackbody_to_rgb, converting the spectrum of the blackbody at T.
+//
+ygl::vec3f blackbody_to_rgb_exact(float T, float scale);
 #endif
\ No newline at end of file
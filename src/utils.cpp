@@ -1,4 +1,5 @@
 #include "utils.h"
+#include <cstring>
 
 //
 // read_file
@@ -97,4 +98,23 @@ std::string concatenate_paths(std::string position, std::string path) {
 		builtPath << position << "/" << path;
 		return builtPath.str();
 	}
-}
\ No newline at end of file
+}
+
+//
+// hash_bytes
+// FNV-1a hash of a memory area, continuing from the hash value h.
+// The data is consumed in 64 bit words, the remaining tail byte by byte.
+//
+uint64_t hash_bytes(const void *data, size_t size, uint64_t h) {
+	const uint64_t prime = 1099511628211ull;
+	auto bytes = (const unsigned char *)data;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		memcpy(&w, bytes + i, 8);
+		h = (h ^ w) * prime;
+	}
+	for (; i < size; i++)
+		h = (h ^ bytes[i]) * prime;
+	return h;
+}
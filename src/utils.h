@@ -5,6 +5,10 @@
 #include <cctype>
 #include <fstream>
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
 
 //
 // read_file
@@ -36,4 +40,60 @@ std::string standardize_path_separator(std::string path);
 //
 std::string concatenate_paths(std::string position, std::string path);
 
+//
+// hash_bytes
+// FNV-1a hash of a memory area, continuing from the hash value h.
+//
+uint64_t hash_bytes(const void *data, size_t size, uint64_t h = 14695981039346656037ull);
+
+//
+// parallel_for
+// Splits the range [0, count) in contiguous chunks and calls func(start, end)
+// on each chunk from a different thread. Small ranges run on the calling thread.
+//
+template <typename Func>
+void parallel_for(int count, Func &&func, int grain = 4096) {
+	int nthreads = (int)std::thread::hardware_concurrency();
+	if (nthreads < 1) nthreads = 1;
+	nthreads = std::min(nthreads, (count + grain - 1) / grain);
+	if (nthreads <= 1) {
+		if (count > 0) func(0, count);
+		return;
+	}
+	std::vector<std::thread> threads;
+	int chunk = (count + nthreads - 1) / nthreads;
+	for (int t = 0; t < nthreads; t++) {
+		int start = t * chunk;
+		int end = std::min(count, start + chunk);
+		if (start >= end) break;
+		threads.push_back(std::thread([&func, start, end]() { func(start, end); }));
+	}
+	for (auto &th : threads)
+		th.join();
+}
+
+//
+// parallel_tasks
+// Calls func(i) for every i in [0, count), each thread taking the next index
+// as soon as it is free, for tasks of uneven cost. nthreads == 0 uses all the cores.
+//
+template <typename Func>
+void parallel_tasks(int count, Func &&func, int nthreads = 0) {
+	if (nthreads <= 0) nthreads = (int)std::thread::hardware_concurrency();
+	nthreads = std::min(std::max(nthreads, 1), count);
+	if (nthreads <= 1) {
+		for (int i = 0; i < count; i++) func(i);
+		return;
+	}
+	std::atomic<int> next(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nthreads; t++) {
+		threads.push_back(std::thread([&func, &next, count]() {
+			for (int i = next++; i < count; i = next++) func(i);
+		}));
+	}
+	for (auto &th : threads)
+		th.join();
+}
+
 #endif
\ No newline at end of file